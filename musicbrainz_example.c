@@ -16,9 +16,10 @@
 
     Buildable with a command line like this:
 
-    gcc -g -o musicbrainz_example musicbrainz_example.c `pkg-config libmusicbrainz5 --cflags --libs` `pkg-config libdiscid --cflags --libs` `pkg-config glib-2.0 --cflags --libs`
+    gcc -g -o musicbrainz_example musicbrainz_example.c `pkg-config libmusicbrainz5 --cflags --libs` `pkg-config libdiscid --cflags --libs` `pkg-config glib-2.0 --cflags --libs` `pkg-config json-glib-1.0 --cflags --libs`
 
-    To build on a Debian machine, requires the libraries libdiscid-dev, libmusicbrainz5-dev and libglib2.0-dev
+    To build on a Debian machine, requires the libraries libdiscid-dev, libmusicbrainz5-dev, libglib2.0-dev
+    and libjson-glib-dev
     (available in the Debian repositories).
 
 */
@@ -26,379 +27,5609 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <glib.h>
+#include <json-glib/json-glib.h>
 
 #include "musicbrainz5/mb5_c.h"
 
 #include "discid/discid.h"
 
-gchar *time_string(int value)
+/* Includes requested on the discid query itself. These are enough to render a
+ * release without fetching it again, see release_is_complete().
+ */
+#define DISCID_INCLUDES "recordings artist-credits release-groups"
+
+/* Includes requested when a release has to be fetched on its own, just what
+ * extract_release() uses. The disc IDs are needed to find the medium.
+ */
+#define RELEASE_INCLUDES "artists recordings release-groups discids artist-credits"
+
+typedef enum {
+    LOOKUP_MODE_SINGLE,         /* one enriched discid query, per-release fetch only as fallback */
+    LOOKUP_MODE_PER_RELEASE,    /* plain discid query, then one query per release */
+    LOOKUP_MODE_COMPARE         /* run both of the above and compare the output */
+} LookupMode;
+
+/* What fuzzy matching needs to know about a disc, in sectors */
+typedef struct {
+    guint32 track_count;        /* 0 if only the disc ID is known */
+    guint32 leadout;
+    guint32 offsets[99];
+} DiscToc;
+
+
+void disc_toc_from_discid(DiscToc *toc, DiscId *disc)
 {
-    int h, m, s;
-    gchar *result = NULL;
+    int first = discid_get_first_track_num(disc);
+
+    toc->track_count = discid_get_last_track_num(disc) - first + 1;
+    toc->leadout = discid_get_sectors(disc);
 
-    h = (value / 3600);
-    m = (value / 60) % 60;
-    s = value % 60;
+    for (guint32 i = 0; i < toc->track_count; i++)
+        toc->offsets[i] = discid_get_track_offset(disc, first + i);
+}
 
-    result = g_strdup_printf("%02d:%02d:%02d", h, m, s);
 
-    return result;
+/*
+ * Stage metrics
+ *
+ * The time spent in each stage of a lookup goes into a histogram per stage,
+ * over the whole run. Buckets double in width, bucket i counting durations
+ * below 2^i microseconds, and the last one everything longer. Timing is
+ * only done with --metrics (or in daemon mode); otherwise metrics_now()
+ * returns 0 and metrics_record() does nothing.
+ */
+
+typedef enum {
+    STAGE_DISC_READ,
+    STAGE_CACHE_LOOKUP,
+    STAGE_INDEX_LOOKUP,
+    STAGE_SCHEDULER_WAIT,
+    STAGE_DISCID_QUERY,         /* HTTP round trip and XML parsing, both inside libmusicbrainz */
+    STAGE_RELEASE_QUERY,
+    STAGE_MEDIUM_MATCHING,
+    STAGE_TRACK_EXTRACTION,
+    STAGE_OUTPUT,
+    STAGE_COUNT
+} Stage;
+
+#define METRICS_BUCKETS 27
+
+typedef struct {
+    guint64 count;
+    guint64 total;              /* in nanoseconds */
+    guint64 max;
+    guint64 buckets[METRICS_BUCKETS];
+} StageHistogram;
+
+static const char *stage_names[STAGE_COUNT] = {
+    "disc_read",
+    "cache_lookup",
+    "index_lookup",
+    "scheduler_wait",
+    "discid_query",
+    "release_query",
+    "medium_matching",
+    "track_extraction",
+    "output"
+};
+
+static StageHistogram stage_histograms[STAGE_COUNT];
+static GMutex metrics_lock;
+static gboolean metrics_enabled = FALSE;
+
+
+/* Monotonic time in nanoseconds, for metrics_record() */
+gint64 metrics_now(void)
+{
+    struct timespec now;
+
+    if (!metrics_enabled)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (gint64)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-    
-int cd_lookup(char *discid)
+
+/* Account the time since start, as returned by metrics_now(), to stage */
+void metrics_record(Stage stage, gint64 start)
 {
-    Mb5ArtistCredit artist_credit;
-    Mb5NameCreditList name_credit_list;
-    int required_size;
-    
-    Mb5Query query = mb5_query_new("musicbrainz_example-1.0", NULL, 0);
-    if (query)
-    {
-        Mb5Metadata metadata1 = mb5_query_query(query, "discid", discid, "", 0, NULL, NULL);
-        char errormessage[256];
+    StageHistogram *histogram = &stage_histograms[stage];
+    guint64 duration;
+    guint64 micros;
+    guint bucket;
+
+    if (!metrics_enabled)
+        return;
+
+    duration = metrics_now() - start;
+    micros = duration / 1000;
+    bucket = micros ? MIN(g_bit_storage(micros), METRICS_BUCKETS - 1) : 0;
+
+    g_mutex_lock(&metrics_lock);
+    histogram->count++;
+    histogram->total += duration;
+    histogram->max = MAX(histogram->max, duration);
+    histogram->buckets[bucket]++;
+    g_mutex_unlock(&metrics_lock);
+}
+
+
+/* Upper bound of a bucket in seconds, the last one has none */
+gdouble metrics_bucket_bound(guint bucket)
+{
+    return (gdouble)(G_GUINT64_CONSTANT(1) << bucket) / G_USEC_PER_SEC;
+}
+
+
+/* Estimated from the buckets: the bound of the bucket the quantile falls in */
+gdouble metrics_quantile(const StageHistogram *histogram, gdouble quantile)
+{
+    guint64 rank = quantile * histogram->count;
+    guint64 seen = 0;
+
+    // Rounded up, and at least the first sample
+    if (rank < quantile * histogram->count || rank == 0)
+        rank++;
+
+    for (guint bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+
+        if (seen >= rank) {
+            if (bucket == METRICS_BUCKETS - 1)
+                break;
+            return MIN(metrics_bucket_bound(bucket), histogram->max / 1e9);
+        }
+    }
+
+    return histogram->max / 1e9;
+}
+
+
+void metrics_append_json(GString *out, const StageHistogram *histograms)
+{
+    g_string_append(out, "{\n  \"stages\": {");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StageHistogram *histogram = &histograms[stage];
+        guint64 cumulative = 0;
+
+        g_string_append_printf(out, "%s\n    \"%s\": {\"count\": %" G_GUINT64_FORMAT ", \"sum_seconds\": %.9g, \"max_seconds\": %.9g, "
+                               "\"p50_seconds\": %.9g, \"p90_seconds\": %.9g, \"p99_seconds\": %.9g, \"buckets\": [",
+                               stage ? "," : "", stage_names[stage], histogram->count, histogram->total / 1e9, histogram->max / 1e9,
+                               metrics_quantile(histogram, 0.5), metrics_quantile(histogram, 0.9), metrics_quantile(histogram, 0.99));
+
+        for (guint bucket = 0; bucket < METRICS_BUCKETS - 1; bucket++) {
+            cumulative += histogram->buckets[bucket];
+            g_string_append_printf(out, "{\"le\": %.9g, \"count\": %" G_GUINT64_FORMAT "}, ", metrics_bucket_bound(bucket), cumulative);
+        }
+
+        g_string_append_printf(out, "{\"le\": \"+Inf\", \"count\": %" G_GUINT64_FORMAT "}]}", histogram->count);
+    }
+
+    g_string_append(out, "\n  }\n}\n");
+}
+
+
+void metrics_append_prometheus(GString *out, const StageHistogram *histograms)
+{
+    g_string_append(out, "# HELP musicbrainz_example_stage_duration_seconds Time spent in each stage of a lookup.\n"
+                         "# TYPE musicbrainz_example_stage_duration_seconds histogram\n");
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StageHistogram *histogram = &histograms[stage];
+        guint64 cumulative = 0;
+
+        for (guint bucket = 0; bucket < METRICS_BUCKETS - 1; bucket++) {
+            cumulative += histogram->buckets[bucket];
+            g_string_append_printf(out, "musicbrainz_example_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %" G_GUINT64_FORMAT "\n",
+                                   stage_names[stage], metrics_bucket_bound(bucket), cumulative);
+        }
+
+        g_string_append_printf(out, "musicbrainz_example_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                               stage_names[stage], histogram->count);
+        g_string_append_printf(out, "musicbrainz_example_stage_duration_seconds_sum{stage=\"%s\"} %.9g\n",
+                               stage_names[stage], histogram->total / 1e9);
+        g_string_append_printf(out, "musicbrainz_example_stage_duration_seconds_count{stage=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                               stage_names[stage], histogram->count);
+    }
+}
+
+
+/* format is "json" or "prometheus", returns FALSE for anything else */
+gboolean metrics_append(GString *out, const char *format)
+{
+    StageHistogram histograms[STAGE_COUNT];
+
+    if (g_strcmp0(format, "json") != 0 && g_strcmp0(format, "prometheus") != 0)
+        return FALSE;
+
+    // Render from a snapshot, so lookups aren't held up
+    g_mutex_lock(&metrics_lock);
+    memcpy(histograms, stage_histograms, sizeof(histograms));
+    g_mutex_unlock(&metrics_lock);
+
+    if (g_strcmp0(format, "json") == 0)
+        metrics_append_json(out, histograms);
+    else
+        metrics_append_prometheus(out, histograms);
+
+    return TRUE;
+}
+
+
+/*
+ * Memory ceiling
+ *
+ * A response parsed by libmusicbrainz can take several MB for a big box set,
+ * and with many lookups and fan-out fetches in flight these add up. With a
+ * ceiling set, a response is only parsed concurrently with others while the
+ * process's anonymous memory is below it. Above it, mb5_query_query() calls
+ * run one at a time across the whole process, after handing freed memory
+ * back to the system, so the process stops growing with the number of
+ * lookups in flight. The gate is only taken once the scheduler has let the
+ * request go, so waiting for a token or backing off doesn't hold it.
+ *
+ * Pages of the mapped offline index and disc cache are resident too, but
+ * the kernel can drop them whenever it likes and malloc_trim() can't, so
+ * they don't count towards the ceiling.
+ */
+
+static gsize memory_ceiling = 0;        /* in bytes, 0 for none */
+static GMutex memory_gate;
+static gint memory_throttled = 0;
+
+
+/* Resident and shared (file-backed or shm) pages, in bytes, 0 if they can't be told */
+void read_statm(gsize *resident, gsize *shared)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long size, resident_pages = 0, shared_pages = 0;
+
+    *resident = *shared = 0;
+
+    if (statm == NULL)
+        return;
+
+    if (fscanf(statm, "%lu %lu %lu", &size, &resident_pages, &shared_pages) == 3) {
+        *resident = (gsize)resident_pages * sysconf(_SC_PAGESIZE);
+        *shared = (gsize)shared_pages * sysconf(_SC_PAGESIZE);
+    }
+
+    fclose(statm);
+}
+
+
+/* In bytes, 0 if it can't be told */
+gsize resident_memory(void)
+{
+    gsize resident, shared;
+
+    read_statm(&resident, &shared);
+
+    return resident;
+}
+
+
+/* Resident pages of our own (the heap, thread stacks), leaving out mapped files, in bytes */
+gsize anonymous_memory(void)
+{
+    gsize resident, shared;
+
+    read_statm(&resident, &shared);
+
+    return resident > shared ? resident - shared : 0;
+}
+
+
+/* Returns TRUE if the gate was taken, to be passed to memory_gate_leave() */
+gboolean memory_gate_enter(void)
+{
+    if (memory_ceiling == 0 || anonymous_memory() < memory_ceiling)
+        return FALSE;
+
+    g_mutex_lock(&memory_gate);
+    g_atomic_int_inc(&memory_throttled);
+
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+
+    return TRUE;
+}
+
+
+void memory_gate_leave(gboolean gated)
+{
+    if (gated)
+        g_mutex_unlock(&memory_gate);
+}
+
+
+/*
+ * Request scheduler
+ *
+ * Every query to the server goes through scheduled_query(), which takes a
+ * token from a bucket refilled at the rate the server allows us. When the
+ * server answers 503 the rate is halved and nothing is sent for a while;
+ * every successful request then raises the rate a little again, up to the
+ * configured maximum. Failed requests are retried a bounded number of times
+ * with a jittered, exponentially growing delay.
+ *
+ * Interactive lookups (the disc in the drive) take precedence over bulk ones
+ * (batch mode): a bulk request only gets a token when no interactive request
+ * is waiting.
+ */
+
+typedef enum {
+    QUERY_PRIORITY_INTERACTIVE,
+    QUERY_PRIORITY_BULK,
+    QUERY_PRIORITY_COUNT
+} QueryPriority;
+
+/* How the server answered an attempt, for query_scheduler_report() */
+typedef enum {
+    QUERY_OUTCOME_SUCCESS,
+    QUERY_OUTCOME_THROTTLED,    /* a 503 */
+    QUERY_OUTCOME_FAILED        /* anything else, the server may not have seen it */
+} QueryOutcome;
+
+#define SCHEDULER_DEFAULT_RATE 1.0         /* requests per second */
+#define SCHEDULER_MIN_RATE 0.05
+#define SCHEDULER_RATE_STEP 0.05           /* added to the rate after each success */
+#define SCHEDULER_THROTTLE_PAUSE (2 * G_USEC_PER_SEC)
+#define SCHEDULER_RETRY_DELAY (1 * G_USEC_PER_SEC)
+#define SCHEDULER_MAX_RETRY_DELAY (30 * G_USEC_PER_SEC)
+
+typedef struct {
+    GMutex lock;
+    GCond cond;
+
+    gdouble max_rate;
+    gdouble rate;
+    gdouble burst;
+    gdouble tokens;
+    gint64 last_refill;
+    gint64 paused_until;        /* no requests before this, after a 503 */
+    guint max_retries;
+    guint waiting[QUERY_PRIORITY_COUNT];
+
+    /* Statistics */
+    guint64 requests;
+    guint64 retries;
+    guint64 throttled;
+    guint64 failed;
+    guint max_queue_depth;
+    gint64 total_wait;          /* in microseconds */
+    gint64 max_wait;
+} QueryScheduler;
+
+static QueryScheduler scheduler;
+
+
+void query_scheduler_init(QueryScheduler *sched, gdouble rate, gdouble burst, guint max_retries)
+{
+    memset(sched, 0, sizeof(*sched));
+
+    g_mutex_init(&sched->lock);
+    g_cond_init(&sched->cond);
+
+    sched->max_rate = MAX(rate, SCHEDULER_MIN_RATE);
+    sched->rate = sched->max_rate;
+    sched->burst = MAX(burst, 1.0);
+    sched->tokens = sched->burst;
+    sched->last_refill = g_get_monotonic_time();
+    sched->max_retries = max_retries;
+}
+
+
+/* Wait until we are allowed to send a request */
+void query_scheduler_acquire(QueryScheduler *sched, QueryPriority priority)
+{
+    gint64 start = g_get_monotonic_time();
+    gint64 waited;
+    guint depth = 0;
+
+    g_mutex_lock(&sched->lock);
+
+    sched->waiting[priority]++;
+    for (int i = 0; i < QUERY_PRIORITY_COUNT; i++)
+        depth += sched->waiting[i];
+    sched->max_queue_depth = MAX(sched->max_queue_depth, depth);
+
+    for (;;) {
+        gint64 now = g_get_monotonic_time();
+        gint64 deadline;
+
+        sched->tokens = MIN(sched->burst, sched->tokens + (now - sched->last_refill) * sched->rate / G_USEC_PER_SEC);
+        sched->last_refill = now;
+
+        gboolean outranked = priority != QUERY_PRIORITY_INTERACTIVE && sched->waiting[QUERY_PRIORITY_INTERACTIVE] > 0;
+
+        if (now >= sched->paused_until && sched->tokens >= 1.0 && !outranked) {
+            sched->tokens -= 1.0;
+            break;
+        }
+
+        if (now < sched->paused_until)
+            deadline = sched->paused_until;
+        else
+            deadline = now + (gint64)((1.0 - MIN(sched->tokens, 1.0)) * G_USEC_PER_SEC / sched->rate) + 1;
+
+        g_cond_wait_until(&sched->cond, &sched->lock, deadline);
+    }
+
+    sched->waiting[priority]--;
+
+    waited = g_get_monotonic_time() - start;
+    sched->requests++;
+    sched->total_wait += waited;
+    sched->max_wait = MAX(sched->max_wait, waited);
+
+    // Let lower priority requests re-check if they may go now
+    g_cond_broadcast(&sched->cond);
+
+    g_mutex_unlock(&sched->lock);
+}
+
+
+/*
+ * Adjust the rate to how the server answered: halve it on a 503, raise it
+ * again on a success. Other failures (connection errors, timeouts, 404s)
+ * say nothing about how loaded the server is, so they leave it alone.
+ */
+void query_scheduler_report(QueryScheduler *sched, QueryOutcome outcome)
+{
+    g_mutex_lock(&sched->lock);
+
+    switch (outcome) {
+    case QUERY_OUTCOME_THROTTLED:
+        sched->throttled++;
+        sched->rate = MAX(SCHEDULER_MIN_RATE, sched->rate / 2);
+        sched->tokens = 0;
+        sched->paused_until = g_get_monotonic_time() + SCHEDULER_THROTTLE_PAUSE;
+        break;
+    case QUERY_OUTCOME_SUCCESS:
+        sched->rate = MIN(sched->max_rate, sched->rate + SCHEDULER_RATE_STEP);
+        break;
+    case QUERY_OUTCOME_FAILED:
+        break;
+    }
+
+    g_mutex_unlock(&sched->lock);
+}
+
+
+void query_scheduler_print_stats(QueryScheduler *sched, FILE *stream)
+{
+    g_mutex_lock(&sched->lock);
+
+    fprintf(stream, "Scheduler: %" G_GUINT64_FORMAT " request(s), %" G_GUINT64_FORMAT " retried, %" G_GUINT64_FORMAT " throttled, %" G_GUINT64_FORMAT " failed\n",
+            sched->requests, sched->retries, sched->throttled, sched->failed);
+    fprintf(stream, "Scheduler: max queue depth %u, wait mean %.1f ms, max %.1f ms, current rate %.2f/s\n",
+            sched->max_queue_depth,
+            sched->requests ? sched->total_wait / 1000.0 / sched->requests : 0.0,
+            sched->max_wait / 1000.0, sched->rate);
+
+    g_mutex_unlock(&sched->lock);
+}
+
+
+/*
+ * mb5_query_query() through the scheduler. The result and HTTP code of the
+ * last attempt are left in the query object as usual.
+ *
+ * libmusicbrainz doesn't give us the response headers, so a Retry-After sent
+ * with a 503 can't be honoured; we pause for SCHEDULER_THROTTLE_PAUSE instead.
+ */
+Mb5Metadata scheduled_query(Mb5Query query, QueryPriority priority, const char *entity, const char *id, const char *resource,
+                            int num_params, char **param_names, char **param_values)
+{
+    Stage stage = g_strcmp0(entity, "discid") == 0 ? STAGE_DISCID_QUERY : STAGE_RELEASE_QUERY;
+    Mb5Metadata metadata = NULL;
+
+    for (guint attempt = 0; ; attempt++) {
+        gint64 start = metrics_now();
+
+        query_scheduler_acquire(&scheduler, priority);
+        metrics_record(STAGE_SCHEDULER_WAIT, start);
+
+        gboolean gated = memory_gate_enter();
+
+        start = metrics_now();
+        metadata = mb5_query_query(query, entity, id, resource, num_params, param_names, param_values);
+        metrics_record(stage, start);
+
+        memory_gate_leave(gated);
 
         tQueryResult result = mb5_query_get_lastresult(query);
         int httpcode = mb5_query_get_lasthttpcode(query);
+        gboolean throttled = httpcode == 503;
+        gboolean retryable = throttled || result == eQuery_ConnectionError || result == eQuery_Timeout;
 
-        mb5_query_get_lasterrormessage(query, errormessage, sizeof(errormessage));
-        printf("Result: %d\nHTTPCode: %d\nErrorMessage: '%s'\n", result, httpcode, errormessage);
+        if (throttled)
+            query_scheduler_report(&scheduler, QUERY_OUTCOME_THROTTLED);
+        else if (metadata && result == eQuery_Success)
+            query_scheduler_report(&scheduler, QUERY_OUTCOME_SUCCESS);
+        else
+            query_scheduler_report(&scheduler, QUERY_OUTCOME_FAILED);
 
-        if (metadata1)
-        {
-            Mb5Disc disc = mb5_metadata_get_disc(metadata1);
-            if (disc)
-            {
-                Mb5ReleaseList release_list = mb5_disc_get_releaselist(disc);
-                if (release_list)
-                {
-                    /*
-                     *if we want to keep an object around for a while, we can
-                     *clone it. We are now responsible for deleting the object
-                    */
+        if (metadata || !retryable)
+            break;
 
-                    int current_release = 0;
+        if (attempt >= scheduler.max_retries) {
+            g_mutex_lock(&scheduler.lock);
+            scheduler.failed++;
+            g_mutex_unlock(&scheduler.lock);
+            break;
+        }
 
-                    printf("Found %d release(s)\n", mb5_release_list_size(release_list));
-                    
-                    printf("---------------------------------\n");
+        g_mutex_lock(&scheduler.lock);
+        scheduler.retries++;
+        g_mutex_unlock(&scheduler.lock);
 
-                    for (current_release = 0; current_release < mb5_release_list_size(release_list); current_release++)
-                    {
-                        Mb5Metadata metadata2 = 0;
-                        Mb5Release Release = mb5_release_list_item(release_list, current_release);
+        // Exponential backoff with jitter, so retrying workers spread out
+        gint64 delay = MIN(SCHEDULER_MAX_RETRY_DELAY, SCHEDULER_RETRY_DELAY << attempt);
 
-                        if (Release)
-                        {
-                            /* The releases returned from LookupDiscID don't contain full information */
+        g_usleep(delay * g_random_double_range(0.5, 1.5));
+    }
 
-                            char **ParamNames;
-                            char **ParamValues;
-                            char release_ID[256];
+    return metadata;
+}
 
-                            ParamNames = malloc(sizeof(char *));
-                            ParamNames[0] = malloc(256);
-                            ParamValues = malloc(sizeof(char *));
-                            ParamValues[0] = malloc(256);
 
-                            strcpy(ParamNames[0], "inc");
-                            strcpy(ParamValues[0], "artists labels recordings release-groups url-rels discids artist-credits");
+/* Where queries go, NULL and 0 for the MusicBrainz server */
+static gchar *query_server = NULL;
+static gint query_port = 0;
 
-                            mb5_release_get_id(Release, release_ID, sizeof(release_ID));
 
-                            metadata2 = mb5_query_query(query, "release", release_ID, "", 1, ParamNames, ParamValues);
+Mb5Query new_query(void)
+{
+    return mb5_query_new("musicbrainz_example-1.0", query_server, query_port);
+}
 
-                            if (metadata2)
-                            {
-                                Mb5Release full_release = mb5_metadata_get_release(metadata2);
-                                
-                                
-                                // Get the album artist
-                                artist_credit = mb5_release_get_artistcredit(full_release);
-                                name_credit_list = mb5_artistcredit_get_namecreditlist(artist_credit);
-                                
-                                for (int i = 0; i < mb5_namecredit_list_size (name_credit_list); i++) {
-                                    Mb5NameCredit  name_credit = mb5_namecredit_list_item (name_credit_list, i);
-                                    Mb5Artist      artist;
-                                    char          *artist_name = NULL;
-                                    // char          *artist_id = NULL;
 
-                                    artist = mb5_namecredit_get_artist (name_credit);
+static GPrivate thread_query_key = G_PRIVATE_INIT((GDestroyNotify)mb5_query_delete);
 
-                                    required_size = mb5_artist_get_name (artist, artist_name, 0);
-                                    artist_name = g_new (char, required_size + 1);
-                                    mb5_artist_get_name (artist, artist_name, required_size + 1);
-                                    //debug (DEBUG_INFO, "==> [MB] ARTIST NAME: %s\n", artist_name);
-                                    printf("Release artist: %s\n", artist_name);
 
-                                    g_free (artist_name);
-                                }
-                                
-                                if (full_release)
-                                {
-                                    /*
-                                     * However, these releases will include information for all media in the release
-                                     * So we need to filter out the only the media we want.
-                                     */
-
-                                    Mb5MediumList MediumList = mb5_release_media_matching_discid(full_release, discid);
-                                    if (MediumList)
-                                    {
-                                        if (mb5_medium_list_size(MediumList))
-                                        {
-                                            int current_medium = 0;
-
-                                            Mb5ReleaseGroup ReleaseGroup = mb5_release_get_releasegroup(full_release);
-                                            if (ReleaseGroup)
-                                            {
-                                                /* One way of getting a string, just use a buffer that
-                                                 * you're pretty sure will accomodate the whole string
-                                                 */
-
-                                                char Title[256];
-
-                                                mb5_releasegroup_get_title(ReleaseGroup, Title, sizeof(Title));
-                                                printf("Release group title: '%s'\n", Title);
-                                            }
-                                            else
-                                                printf("No release group for this release\n");
-
-                                            printf("Found %d media item(s)\n", mb5_medium_list_size(MediumList));
-
-                                            for (current_medium = 0; current_medium < mb5_medium_list_size(MediumList); current_medium++)
-                                            {
-                                                Mb5Medium Medium = mb5_medium_list_item(MediumList, current_medium);
-                                                if (Medium)
-                                                {
-                                                    int alloc_size = 10;
-                                                    char *MediumTitle = malloc(alloc_size);
-                                                    int required_size;
-
-                                                    Mb5TrackList TrackList = mb5_medium_get_tracklist(Medium);
-
-                                                    /* Another way of getting a string. Preallocate a buffer
-                                                     * and check if if was big enough when retrieving string.
-                                                     * If not, reallocate it to be big enough and get it again.
-                                                     */
-
-                                                    required_size = mb5_medium_get_title(Medium, MediumTitle, alloc_size);
-                                                    if (required_size > alloc_size)
-                                                    {
-                                                        MediumTitle = realloc(MediumTitle, required_size+1);
-                                                        mb5_medium_get_title(Medium, MediumTitle, required_size+1);
-                                                    }
-
-                                                    printf("Found media: '%s', position %d\n", MediumTitle, mb5_medium_get_position(Medium));
-                                                    
-                                                    GSList *artist_list = NULL;
-                                                    GSList *temp_list = NULL;
-                                                    
-                                                    gchar *temp_string = NULL;
-                                                    
-                                                    gboolean compilation = FALSE;
-                                                           
-                                                    if (TrackList)
-                                                    {
-                                                        int current_track=0;
-                                                        
-                                                        
-                                                        gchar *temp_artist = NULL; // g_strdup("");
-                                                        
-                                                        temp_list = artist_list;
-                                                            
-
-                                                        for (current_track = 0; current_track < mb5_track_list_size(TrackList); current_track++)
-                                                        {
-                                                            Mb5Track track=mb5_track_list_item(TrackList, current_track);
-                                                            Mb5Recording recording=mb5_track_get_recording(track);
-                                                            
-                                                            
-                                                            // Get the artist from track
-                                                            if (recording)
-                                                            {
-                                                                Mb5ArtistCredit track_artist_credit = mb5_artistcredit_clone(mb5_recording_get_artistcredit(recording));
-                                                                Mb5NameCreditList temp_name_credit_list = mb5_artistcredit_get_namecreditlist(track_artist_credit);
-                                                                
-                                                                Mb5NameCreditList new_name_credit_list = mb5_namecredit_list_clone(temp_name_credit_list);
-                                                                
-                                                                // Get per track artist
-                                                                
-                                                                int size = mb5_namecredit_list_size(new_name_credit_list);
-                                
-                                                                for (int i = 0; i < size; i++) {
-                                                                    Mb5NameCredit new_name_credit = mb5_namecredit_list_item (new_name_credit_list, i);
-                                                                    Mb5Artist artist;
-                                                                    char *artist_name = NULL;
-                                                                    
-                                                                    artist = mb5_namecredit_get_artist (new_name_credit);
-
-                                                                    required_size = mb5_artist_get_name (artist, artist_name, 0);
-                                                                    artist_name = g_new (char, required_size + 1);
-                                                                    mb5_artist_get_name (artist, artist_name, required_size + 1);
-
-                                                                    gchar *temp_artist = g_strdup(artist_name);
-                                                                    
-                                                                    g_free(artist_name);
-
-                                                                    temp_list = g_slist_append(temp_list, temp_artist);
-                                                                }
-                                                                
-                                                                artist_list = temp_list;
-                                                                
-                                                                mb5_artistcredit_delete(track_artist_credit);
-                                                                
-                                                                mb5_namecredit_list_delete(new_name_credit_list);
-                                                            }
-                                                        }
-                                                        
-                                                        // Check if it is a Compilation CD (This might be doable using the MusicBrainz API,
-                                                        // I haven't checked carefully. I assume it is, if there's several different artists, and
-                                                        // not one and the same for all the tracks.
-                                                        //
-                                                        if (artist_list != NULL) {
-                                                            
-                                                            for (temp_list = artist_list; temp_list != NULL; temp_list = temp_list -> next) {
-                                                                
-                                                                if (temp_string == NULL) {
-                                                                    temp_string = g_strdup(temp_list->data);
-                                                                } else {
-                                                                    
-                                                                    if (g_strcmp0(temp_list->data, temp_string) != 0) {
-                                                                        compilation = TRUE;
-                                                                    }
-                                                                }
-                                                            }
-                                                            if (temp_string != NULL) {
-                                                                g_free(temp_string);
-                                                            }
-                                                        }
-                                                    }
-
-                                                    if (TrackList)
-                                                    {
-                                                        int current_track = 0;
-                                                        
-                                                        GSList *list = artist_list;
-
-                                                        int tracklist_offset = mb5_track_list_get_offset(TrackList);
-
-                                                        printf("Tracklist offset: %d\n", tracklist_offset);
-
-                                                        for (current_track = 0; current_track < mb5_track_list_size(TrackList); current_track++)
-                                                        {
-                                                            char *track_title = 0;
-                                                            int required_length = 0;
-
-                                                            Mb5Track track = mb5_track_list_item(TrackList, current_track);
-                                                            Mb5Recording recording = mb5_track_get_recording(track);
-                                                            
-                                                            /* Yet another way of getting string. Call it once to
-                                                             * find out how long the buffer needs to be, allocate
-                                                             * enough space and then call again.
-                                                             */
-                                                            
-                                                            if (recording)
-                                                            {
-                                                                required_length = mb5_recording_get_title(recording, track_title, 0);
-                                                                track_title = malloc(required_length + 1);
-                                                                mb5_recording_get_title(recording, track_title, required_length + 1);
-                                                            }
-                                                            else
-                                                            {
-                                                                required_length = mb5_track_get_title(track, track_title, 0);
-                                                                track_title = malloc(required_length + 1);
-                                                                mb5_track_get_title(track, track_title, required_length + 1);
-                                                            }
-
-                                                            int track_length = mb5_track_get_length(track);
-
-                                                            gchar *temp_time_string = time_string(track_length / 1000);
-
-                                                            // If a compilation, print artist for each track.
-                                                            if (compilation) {
-                                                                printf("%02d - %s - '%s' (%s)\n", mb5_track_get_position(track), (gchar*)(list->data), track_title, temp_time_string);
-                                                            } else {
-                                                                printf("%02d - '%s' (%s)\n", mb5_track_get_position(track), track_title, temp_time_string);
-                                                            }
-                                                            
-                                                            g_free(temp_time_string);
-
-                                                            list = list -> next;
-
-                                                            free(track_title);
-                                                        }
-                                                    }
-                                                    
-                                                    printf("Compilation: ");
-                                                    
-                                                    if (compilation) {
-                                                        printf("Yes");
-                                                    } else {
-                                                        printf("No");
-                                                    }
-                                                    
-                                                    printf("\n");
-                                                    
-                                                    g_slist_free_full(artist_list, g_free);
-
-                                                    free(MediumTitle);
-                                                }
-                                            }
-                                        }
-
-                                        /* We must delete the result of 'media_matching_discid' */
-                                        mb5_medium_list_delete(MediumList);
-                                    }
-                                }
+/* A query object owned by the calling thread, created on first use */
+Mb5Query thread_query(void)
+{
+    Mb5Query query = g_private_get(&thread_query_key);
 
-                                /* We must delete anything returned from the query methods */
-                                mb5_metadata_delete(metadata2);
-                            }
+    if (query == NULL) {
+        query = new_query();
+        g_private_set(&thread_query_key, query);
+    }
 
-                            free(ParamValues[0]);
-                            free(ParamValues);
-                            free(ParamNames[0]);
-                            free(ParamNames);
-                        }
-                    }
+    return query;
+}
 
-                    /* We must delete anything we have cloned */
-                    // mb5_release_list_delete(CloneReleaseList);
-                }
-            }
 
-            /* We must delete anything returned from the query methods */
-            mb5_metadata_delete(metadata1);
-        }
+/*
+ * String arena
+ *
+ * Every string extracted during a lookup is bump-allocated from a chain of
+ * blocks owned by the DiscResult, and the whole chain is freed in one go
+ * with it. arena_get_string() copies a string straight out of a
+ * libmusicbrainz object into the arena: it offers the space left in the
+ * current block, and only asks a second time if the string didn't fit, so
+ * there is no truncation and usually a single call.
+ */
 
-        /* We must delete the original query object */
-        mb5_query_delete(query);
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct _ArenaBlock ArenaBlock;
+
+struct _ArenaBlock {
+    ArenaBlock *next;
+    gsize size;
+    gsize used;
+    gchar data[];
+};
+
+typedef struct {
+    ArenaBlock *blocks;     /* the one we allocate from first */
+} Arena;
+
+/* Every mb5_*_get_* string accessor has this shape */
+typedef int (*Mb5StringGetter)(void *object, char *str, int len);
+
+#define ARENA_GET(arena, getter, object) arena_get_string((arena), (Mb5StringGetter)(getter), (object))
+
+/* Allocation statistics, for --alloc-stats */
+static gint arena_string_count = 0;
+static gint arena_block_count = 0;
+
+
+void arena_init(Arena *arena)
+{
+    arena->blocks = NULL;
+}
+
+
+void arena_clear(Arena *arena)
+{
+    while (arena->blocks) {
+        ArenaBlock *next = arena->blocks->next;
+
+        g_free(arena->blocks);
+        arena->blocks = next;
     }
-    
-    return 0;
 }
 
 
-int main(int argc, const char *argv[])
+ArenaBlock *arena_new_block(gsize size)
 {
-    DiscId *disc = discid_new();
-    
-    if ( discid_read_sparse(disc, "/dev/cdrom", 0) == 0 ) {
-        fprintf(stderr, "Error: %s\n", discid_get_error_msg(disc));
+    ArenaBlock *block = g_malloc(sizeof(ArenaBlock) + size);
 
-        discid_free(disc);
-        return 1;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    g_atomic_int_inc(&arena_block_count);
+
+    return block;
+}
+
+
+gchar *arena_alloc(Arena *arena, gsize size)
+{
+    ArenaBlock *block = arena->blocks;
+
+    if (block == NULL || block->size - block->used < size) {
+        if (size > ARENA_BLOCK_SIZE / 4 && block != NULL) {
+            // A large string gets a block of its own, kept behind the
+            // current one so the space left there isn't wasted
+            block = arena_new_block(size);
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block = arena_new_block(MAX(size, ARENA_BLOCK_SIZE));
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
     }
 
-    char *discid = discid_get_id(disc);
+    block->used += size;
 
-    printf("DiscID: %s\n", discid);
+    return block->data + block->used - size;
+}
 
-    cd_lookup(discid);
 
-    discid_free(disc);
+gchar *arena_strndup(Arena *arena, const gchar *string, gsize length)
+{
+    gchar *copy = arena_alloc(arena, length + 1);
 
-    return 0;
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+
+    g_atomic_int_inc(&arena_string_count);
+
+    return copy;
+}
+
+
+gchar *arena_strdup(Arena *arena, const gchar *string)
+{
+    return string ? arena_strndup(arena, string, strlen(string)) : NULL;
+}
+
+
+gchar *arena_get_string(Arena *arena, Mb5StringGetter getter, void *object)
+{
+    ArenaBlock *block = arena->blocks;
+    gchar *string;
+    int available;
+    int required;
+
+    if (block == NULL || block->used == block->size) {
+        block = arena_new_block(ARENA_BLOCK_SIZE);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    string = block->data + block->used;
+    available = MIN(block->size - block->used, G_MAXINT);
+
+    string[0] = '\0';
+    required = getter(object, string, available);
+
+    if (required < available) {
+        block->used += required + 1;
+    } else {
+        string = arena_alloc(arena, required + 1);
+        string[0] = '\0';
+        getter(object, string, required + 1);
+    }
+
+    g_atomic_int_inc(&arena_string_count);
+
+    return string;
+}
+
+
+/* Move all of from's blocks into arena, leaving from empty */
+void arena_steal(Arena *arena, Arena *from)
+{
+    ArenaBlock *last = from->blocks;
+
+    if (last == NULL)
+        return;
+
+    while (last->next)
+        last = last->next;
+
+    if (arena->blocks) {
+        last->next = arena->blocks->next;
+        arena->blocks->next = from->blocks;
+    } else {
+        arena->blocks = from->blocks;
+    }
+
+    from->blocks = NULL;
+}
+
+
+void print_alloc_stats(FILE *stream)
+{
+    fprintf(stream, "Allocations: %d string(s) extracted into %d arena block(s)\n",
+            g_atomic_int_get(&arena_string_count), g_atomic_int_get(&arena_block_count));
+
+    if (memory_ceiling > 0)
+        fprintf(stream, "Memory: %d response(s) parsed one at a time over the %" G_GSIZE_FORMAT " MiB ceiling\n",
+                g_atomic_int_get(&memory_throttled), memory_ceiling >> 20);
+}
+
+
+Mb5Metadata query_with_includes(Mb5Query query, QueryPriority priority, const char *entity, const char *id, const char *includes)
+{
+    char *ParamNames[] = { "inc" };
+    char *ParamValues[] = { (char *)includes };
+
+    return scheduled_query(query, priority, entity, id, "", 1, ParamNames, ParamValues);
+}
+
+
+
+/*
+ * Check if a release returned by the discid query carries everything
+ * extract_release() needs for this disc, so we don't have to fetch it again.
+ */
+gboolean release_is_complete(Mb5Release release, const char *discid)
+{
+    gboolean complete = TRUE;
+    Mb5MediumList MediumList;
+
+    if (!mb5_release_get_artistcredit(release) || !mb5_release_get_releasegroup(release))
+        return FALSE;
+
+    MediumList = mb5_release_media_matching_discid(release, discid);
+    if (!MediumList)
+        return FALSE;
+
+    if (mb5_medium_list_size(MediumList) == 0)
+        complete = FALSE;
+
+    for (int current_medium = 0; complete && current_medium < mb5_medium_list_size(MediumList); current_medium++)
+    {
+        Mb5Medium Medium = mb5_medium_list_item(MediumList, current_medium);
+        Mb5TrackList TrackList = Medium ? mb5_medium_get_tracklist(Medium) : NULL;
+
+        if (!TrackList || mb5_track_list_size(TrackList) == 0) {
+            complete = FALSE;
+            break;
+        }
+
+        // Per-track artists come from the recordings
+        for (int current_track = 0; current_track < mb5_track_list_size(TrackList); current_track++)
+        {
+            if (!mb5_track_get_recording(mb5_track_list_item(TrackList, current_track))) {
+                complete = FALSE;
+                break;
+            }
+        }
+    }
+
+    mb5_medium_list_delete(MediumList);
+
+    return complete;
+}
+
+
+/*
+ * The extracted result of a lookup. This is everything we print about a disc,
+ * so it can be rendered later on, or stored in the disc cache. All strings
+ * live in the result's arena.
+ */
+
+typedef struct {
+    gint position;
+    gint length;            /* in milliseconds */
+    gchar *title;
+    gchar *artist;          /* printed for compilations, may be NULL */
+} TrackResult;
+
+typedef struct {
+    gchar *title;
+    gint position;
+    gboolean has_tracks;    /* FALSE if the medium came without a track list */
+    gint track_offset;
+    gboolean compilation;
+    GArray *tracks;         /* TrackResult */
+} MediumResult;
+
+typedef struct {
+    gchar *id;
+    GPtrArray *artists;     /* release artist names, one per name credit */
+    gchar *group_title;     /* NULL if the release has no release group */
+    GArray *media;          /* MediumResult, NULL if no medium matches the disc ID */
+    gchar *fuzzy_discid;    /* the disc whose TOC matched, NULL for an exact match */
+    gint fuzzy_distance;    /* in sectors, summed over the tracks and the lead-out */
+    gboolean failed;        /* the release couldn't be fetched, only the id and the fields below are set */
+    gint query_result;
+    gint http_code;
+    gchar *error_message;
+} ReleaseResult;
+
+typedef struct {
+    gchar *discid;
+    gint query_result;
+    gint http_code;
+    gchar *error_message;
+    GArray *releases;       /* ReleaseResult, NULL if the disc wasn't found */
+    gint failed_releases;   /* releases marked failed in releases */
+    gboolean offline;       /* served from the offline index, strings point into it */
+    gboolean cached;        /* served from the disc cache */
+    gboolean prefetched;    /* built from another disc's release, see prefetch_media */
+    gint64 lookup_time;     /* in microseconds, as seen by lookup_disc() */
+    gchar *device;          /* the drive the disc was read from in multi-drive mode, or NULL */
+    GPtrArray *siblings;    /* DiscResult of the other media of the releases, NULL if none */
+    Arena strings;
+} DiscResult;
+
+
+DiscResult *disc_result_new(const char *discid)
+{
+    DiscResult *result = g_new0(DiscResult, 1);
+
+    arena_init(&result->strings);
+    result->discid = arena_strdup(&result->strings, discid);
+    result->error_message = "";
+
+    return result;
+}
+
+
+void release_result_clear(ReleaseResult *release)
+{
+    if (release->media) {
+        for (guint i = 0; i < release->media->len; i++)
+            g_array_free(g_array_index(release->media, MediumResult, i).tracks, TRUE);
+
+        g_array_free(release->media, TRUE);
+    }
+
+    g_ptr_array_free(release->artists, TRUE);
+}
+
+
+void disc_result_free(DiscResult *result)
+{
+    if (result == NULL)
+        return;
+
+    if (result->releases) {
+        for (guint i = 0; i < result->releases->len; i++)
+            release_result_clear(&g_array_index(result->releases, ReleaseResult, i));
+
+        g_array_free(result->releases, TRUE);
+    }
+
+    // The siblings' strings live in our arena, so they go first
+    if (result->siblings)
+        g_ptr_array_free(result->siblings, TRUE);
+
+    arena_clear(&result->strings);
+    g_free(result);
+}
+
+
+/* The lookup didn't go through, or lost some of the disc's releases */
+gboolean disc_result_failed(const DiscResult *result)
+{
+    return result->query_result != eQuery_Success || result->failed_releases > 0;
+}
+
+
+/*
+ * A result is worth keeping if the lookup went through and found the disc,
+ * with every one of its releases
+ */
+gboolean disc_result_cacheable(const DiscResult *result)
+{
+    return result->query_result == eQuery_Success && result->releases != NULL && result->failed_releases == 0;
+}
+
+
+/*
+ * The artists credited on the tracks of a release. Each artist is stored
+ * once, keyed by its MBID (or its name, if it has none), and tracks refer to
+ * it by index.
+ */
+
+typedef struct {
+    Arena *arena;
+    GHashTable *index;      /* key -> index + 1 */
+    GPtrArray *keys;
+    GPtrArray *names;
+} ArtistTable;
+
+
+void artist_table_init(ArtistTable *table, Arena *arena)
+{
+    table->arena = arena;
+    table->index = g_hash_table_new(g_str_hash, g_str_equal);
+    table->keys = g_ptr_array_new();
+    table->names = g_ptr_array_new();
+}
+
+
+void artist_table_clear(ArtistTable *table)
+{
+    g_hash_table_destroy(table->index);
+    g_ptr_array_free(table->keys, TRUE);
+    g_ptr_array_free(table->names, TRUE);
+}
+
+
+/* Returns the index of the first artist of the credit, or -1 if there is none */
+gint artist_table_intern_credit(ArtistTable *table, Mb5ArtistCredit artist_credit)
+{
+    Mb5NameCreditList name_credit_list = mb5_artistcredit_get_namecreditlist(artist_credit);
+    Mb5Artist artist;
+    char artist_id[64];
+    gpointer index;
+
+    if (mb5_namecredit_list_size(name_credit_list) == 0)
+        return -1;
+
+    artist = mb5_namecredit_get_artist(mb5_namecredit_list_item(name_credit_list, 0));
+
+    // MBIDs are 36 characters, longer IDs are not expected
+    if (mb5_artist_get_id(artist, artist_id, sizeof(artist_id)) > 0) {
+        index = g_hash_table_lookup(table->index, artist_id);
+        if (index)
+            return GPOINTER_TO_INT(index) - 1;
+
+        g_ptr_array_add(table->keys, arena_strdup(table->arena, artist_id));
+        g_ptr_array_add(table->names, ARENA_GET(table->arena, mb5_artist_get_name, artist));
+    } else {
+        gchar *artist_name = ARENA_GET(table->arena, mb5_artist_get_name, artist);
+
+        index = g_hash_table_lookup(table->index, artist_name);
+        if (index)
+            return GPOINTER_TO_INT(index) - 1;
+
+        g_ptr_array_add(table->keys, artist_name);
+        g_ptr_array_add(table->names, artist_name);
+    }
+
+    g_hash_table_insert(table->index, g_ptr_array_index(table->keys, table->keys->len - 1), GINT_TO_POINTER(table->keys->len));
+
+    return table->keys->len - 1;
+}
+
+
+/* Number of different artists in an array of artist indices, ignoring -1 */
+guint artist_table_count_distinct(const ArtistTable *table, GArray *artist_indices)
+{
+    gboolean *seen = g_new0(gboolean, table->keys->len + 1);
+    guint distinct = 0;
+
+    for (guint i = 0; i < artist_indices->len; i++) {
+        gint index = g_array_index(artist_indices, gint, i);
+
+        if (index >= 0 && !seen[index]) {
+            seen[index] = TRUE;
+            distinct++;
+        }
+    }
+
+    g_free(seen);
+
+    return distinct;
+}
+
+
+void extract_release(ReleaseResult *release, Arena *arena, Mb5Release full_release, const char *discid)
+{
+    Mb5ArtistCredit artist_credit;
+    Mb5NameCreditList name_credit_list;
+    ArtistTable artists;
+
+    release->id = ARENA_GET(arena, mb5_release_get_id, full_release);
+    release->artists = g_ptr_array_new();
+    release->group_title = NULL;
+    release->media = NULL;
+    release->fuzzy_discid = NULL;
+    release->failed = FALSE;
+
+    artist_table_init(&artists, arena);
+
+    // Get the album artist
+    artist_credit = mb5_release_get_artistcredit(full_release);
+    name_credit_list = mb5_artistcredit_get_namecreditlist(artist_credit);
+    
+    for (int i = 0; i < mb5_namecredit_list_size (name_credit_list); i++) {
+        Mb5NameCredit name_credit = mb5_namecredit_list_item (name_credit_list, i);
+        Mb5Artist artist = mb5_namecredit_get_artist (name_credit);
+
+        g_ptr_array_add(release->artists, ARENA_GET(arena, mb5_artist_get_name, artist));
+    }
+    
+    if (full_release)
+    {
+        /*
+         * However, these releases will include information for all media in the release
+         * So we need to filter out the only the media we want.
+         */
+
+        gint64 start = metrics_now();
+        Mb5MediumList MediumList = mb5_release_media_matching_discid(full_release, discid);
+
+        metrics_record(STAGE_MEDIUM_MATCHING, start);
+
+        if (MediumList)
+        {
+            if (mb5_medium_list_size(MediumList))
+            {
+                int current_medium = 0;
+
+                Mb5ReleaseGroup ReleaseGroup = mb5_release_get_releasegroup(full_release);
+                if (ReleaseGroup)
+                    release->group_title = ARENA_GET(arena, mb5_releasegroup_get_title, ReleaseGroup);
+
+                release->media = g_array_new(FALSE, TRUE, sizeof(MediumResult));
+
+                for (current_medium = 0; current_medium < mb5_medium_list_size(MediumList); current_medium++)
+                {
+                    Mb5Medium Medium = mb5_medium_list_item(MediumList, current_medium);
+                    if (Medium)
+                    {
+                        MediumResult medium = { 0 };
+
+                        Mb5TrackList TrackList = mb5_medium_get_tracklist(Medium);
+
+                        medium.title = ARENA_GET(arena, mb5_medium_get_title, Medium);
+                        medium.position = mb5_medium_get_position(Medium);
+                        medium.tracks = g_array_new(FALSE, TRUE, sizeof(TrackResult));
+                        
+                        gboolean compilation = FALSE;
+
+                        if (TrackList)
+                        {
+                            gint64 tracks_start = metrics_now();
+                            int current_track = 0;
+                            int track_count = mb5_track_list_size(TrackList);
+                            GArray *track_artists = g_array_sized_new(FALSE, FALSE, sizeof(gint), track_count);
+
+                            medium.has_tracks = TRUE;
+                            medium.track_offset = mb5_track_list_get_offset(TrackList);
+
+                            g_array_set_size(medium.tracks, track_count);
+
+                            for (current_track = 0; current_track < track_count; current_track++)
+                            {
+                                TrackResult *track_result = &g_array_index(medium.tracks, TrackResult, current_track);
+                                gint artist_index = -1;
+
+                                Mb5Track track = mb5_track_list_item(TrackList, current_track);
+                                Mb5Recording recording = mb5_track_get_recording(track);
+                                
+                                if (recording)
+                                {
+                                    track_result->title = ARENA_GET(arena, mb5_recording_get_title, recording);
+
+                                    // Get the artist from track
+                                    artist_index = artist_table_intern_credit(&artists, mb5_recording_get_artistcredit(recording));
+                                }
+                                else
+                                {
+                                    track_result->title = ARENA_GET(arena, mb5_track_get_title, track);
+                                }
+
+                                track_result->position = mb5_track_get_position(track);
+                                track_result->length = mb5_track_get_length(track);
+                                track_result->artist = artist_index >= 0 ? g_ptr_array_index(artists.names, artist_index) : NULL;
+
+                                g_array_append_val(track_artists, artist_index);
+                            }
+
+                            // Check if it is a Compilation CD (This might be doable using the MusicBrainz API,
+                            // I haven't checked carefully. I assume it is, if the tracks are credited to
+                            // several different artists, and not one and the same for all the tracks.
+                            //
+                            compilation = artist_table_count_distinct(&artists, track_artists) > 1;
+
+                            g_array_free(track_artists, TRUE);
+
+                            metrics_record(STAGE_TRACK_EXTRACTION, tracks_start);
+                        }
+                        
+                        medium.compilation = compilation;
+
+                        g_array_append_val(release->media, medium);
+                    }
+                }
+            }
+
+            /* We must delete the result of 'media_matching_discid' */
+            mb5_medium_list_delete(MediumList);
+        }
+    }
+
+    artist_table_clear(&artists);
+}
+
+
+/*
+ * Output
+ *
+ * A lookup is written out as a record, in the text format or as a JSON
+ * object. NDJSON puts one object per line, JSON wraps all of them in a
+ * single array.
+ *
+ * Records are rendered into a large buffer that is written out when full,
+ * or after every record if the consumer reads the output as a stream. The
+ * renderers only ever append to the buffer, so once it has grown to the
+ * size of the largest record nothing is allocated per field or per record.
+ */
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef enum {
+    OUTPUT_FORMAT_TEXT,
+    OUTPUT_FORMAT_JSON,
+    OUTPUT_FORMAT_NDJSON
+} OutputFormat;
+
+typedef struct {
+    FILE *stream;
+    OutputFormat format;
+    gboolean flush_records; /* write each record out as soon as it is rendered */
+    GString *buffer;
+    guint records;
+} OutputWriter;
+
+
+/* Like printf's %0*d */
+void output_append_int(GString *out, gint64 value, guint width)
+{
+    gchar digits[24];
+    guint length = 0;
+    guint64 magnitude = value < 0 ? -(guint64)value : (guint64)value;
+
+    if (value < 0) {
+        g_string_append_c(out, '-');
+        width = width > 0 ? width - 1 : 0;
+    }
+
+    do {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    while (length < width && length < sizeof(digits))
+        digits[length++] = '0';
+
+    while (length > 0)
+        g_string_append_c(out, digits[--length]);
+}
+
+
+/* Like printf's %s */
+void output_append_text(GString *out, const gchar *string)
+{
+    g_string_append(out, string ? string : "(null)");
+}
+
+
+/* A track length as hh:mm:ss */
+void output_append_time(GString *out, int value)
+{
+    output_append_int(out, value / 3600, 2);
+    g_string_append_c(out, ':');
+    output_append_int(out, (value / 60) % 60, 2);
+    g_string_append_c(out, ':');
+    output_append_int(out, value % 60, 2);
+}
+
+
+/* A quoted and escaped JSON string, or null */
+void output_append_json_string(GString *out, const gchar *string)
+{
+    const gchar *run;
+
+    if (string == NULL) {
+        g_string_append(out, "null");
+        return;
+    }
+
+    g_string_append_c(out, '"');
+
+    for (run = string; *string; string++) {
+        guchar c = *string;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        g_string_append_len(out, run, string - run);
+        run = string + 1;
+
+        switch (c) {
+        case '"':  g_string_append(out, "\\\""); break;
+        case '\\': g_string_append(out, "\\\\"); break;
+        case '\n': g_string_append(out, "\\n"); break;
+        case '\r': g_string_append(out, "\\r"); break;
+        case '\t': g_string_append(out, "\\t"); break;
+        default:
+            g_string_append(out, "\\u00");
+            g_string_append_c(out, "0123456789abcdef"[c >> 4]);
+            g_string_append_c(out, "0123456789abcdef"[c & 0xf]);
+        }
+    }
+
+    g_string_append_len(out, run, string - run);
+    g_string_append_c(out, '"');
+}
+
+
+void disc_result_render_text(const DiscResult *result, GString *out)
+{
+    g_string_append(out, "Result: ");
+    output_append_int(out, result->query_result, 0);
+    g_string_append(out, "\nHTTPCode: ");
+    output_append_int(out, result->http_code, 0);
+    g_string_append(out, "\nErrorMessage: '");
+    output_append_text(out, result->error_message);
+    g_string_append(out, "'\n");
+
+    if (result->releases == NULL)
+        return;
+
+    g_string_append(out, "Found ");
+    output_append_int(out, result->releases->len, 0);
+    g_string_append(out, " release(s)\n");
+
+    g_string_append(out, "---------------------------------\n");
+
+    for (guint i = 0; i < result->releases->len; i++) {
+        const ReleaseResult *release = &g_array_index(result->releases, ReleaseResult, i);
+
+        if (release->fuzzy_discid) {
+            g_string_append(out, "Fuzzy match: disc ID ");
+            g_string_append(out, release->fuzzy_discid);
+            g_string_append(out, ", ");
+            output_append_int(out, release->fuzzy_distance, 0);
+            g_string_append(out, " sector(s) off\n");
+        }
+
+        if (release->failed) {
+            g_string_append(out, "Release ");
+            g_string_append(out, release->id);
+            g_string_append(out, " could not be fetched, Result: ");
+            output_append_int(out, release->query_result, 0);
+            g_string_append(out, ", HTTPCode: ");
+            output_append_int(out, release->http_code, 0);
+            g_string_append(out, ", ErrorMessage: '");
+            output_append_text(out, release->error_message);
+            g_string_append(out, "'\n");
+            continue;
+        }
+
+        for (guint j = 0; j < release->artists->len; j++) {
+            g_string_append(out, "Release artist: ");
+            output_append_text(out, g_ptr_array_index(release->artists, j));
+            g_string_append_c(out, '\n');
+        }
+
+        if (release->media == NULL)
+            continue;
+
+        if (release->group_title) {
+            g_string_append(out, "Release group title: '");
+            g_string_append(out, release->group_title);
+            g_string_append(out, "'\n");
+        } else
+            g_string_append(out, "No release group for this release\n");
+
+        g_string_append(out, "Found ");
+        output_append_int(out, release->media->len, 0);
+        g_string_append(out, " media item(s)\n");
+
+        for (guint j = 0; j < release->media->len; j++) {
+            const MediumResult *medium = &g_array_index(release->media, MediumResult, j);
+
+            g_string_append(out, "Found media: '");
+            output_append_text(out, medium->title);
+            g_string_append(out, "', position ");
+            output_append_int(out, medium->position, 0);
+            g_string_append_c(out, '\n');
+
+            if (medium->has_tracks) {
+                g_string_append(out, "Tracklist offset: ");
+                output_append_int(out, medium->track_offset, 0);
+                g_string_append_c(out, '\n');
+            }
+
+            for (guint k = 0; k < medium->tracks->len; k++) {
+                const TrackResult *track = &g_array_index(medium->tracks, TrackResult, k);
+
+                output_append_int(out, track->position, 2);
+                g_string_append(out, " - ");
+
+                // If a compilation, print artist for each track.
+                if (medium->compilation) {
+                    output_append_text(out, track->artist);
+                    g_string_append(out, " - ");
+                }
+
+                g_string_append_c(out, '\'');
+                output_append_text(out, track->title);
+                g_string_append(out, "' (");
+                output_append_time(out, track->length / 1000);
+                g_string_append(out, ")\n");
+            }
+
+            g_string_append(out, "Compilation: ");
+            g_string_append(out, medium->compilation ? "Yes" : "No");
+            g_string_append_c(out, '\n');
+        }
+    }
+}
+
+
+void medium_result_render_json(const MediumResult *medium, GString *out)
+{
+    g_string_append(out, "{\"title\":");
+    output_append_json_string(out, medium->title);
+    g_string_append(out, ",\"position\":");
+    output_append_int(out, medium->position, 0);
+    g_string_append(out, ",\"track_offset\":");
+    if (medium->has_tracks)
+        output_append_int(out, medium->track_offset, 0);
+    else
+        g_string_append(out, "null");
+    g_string_append(out, ",\"compilation\":");
+    g_string_append(out, medium->compilation ? "true" : "false");
+    g_string_append(out, ",\"tracks\":[");
+
+    for (guint i = 0; i < medium->tracks->len; i++) {
+        const TrackResult *track = &g_array_index(medium->tracks, TrackResult, i);
+
+        if (i > 0)
+            g_string_append_c(out, ',');
+
+        g_string_append(out, "{\"position\":");
+        output_append_int(out, track->position, 0);
+        g_string_append(out, ",\"title\":");
+        output_append_json_string(out, track->title);
+        g_string_append(out, ",\"artist\":");
+        output_append_json_string(out, track->artist);
+        g_string_append(out, ",\"length_ms\":");
+        output_append_int(out, track->length, 0);
+        g_string_append_c(out, '}');
+    }
+
+    g_string_append(out, "]}");
+}
+
+
+void release_result_render_json(const ReleaseResult *release, GString *out)
+{
+    g_string_append(out, "{\"id\":");
+    output_append_json_string(out, release->id);
+
+    if (release->failed) {
+        g_string_append(out, ",\"error\":{\"result\":");
+        output_append_int(out, release->query_result, 0);
+        g_string_append(out, ",\"http_code\":");
+        output_append_int(out, release->http_code, 0);
+        g_string_append(out, ",\"message\":");
+        output_append_json_string(out, release->error_message);
+        g_string_append_c(out, '}');
+    }
+
+    g_string_append(out, ",\"artists\":[");
+
+    for (guint i = 0; i < release->artists->len; i++) {
+        if (i > 0)
+            g_string_append_c(out, ',');
+        output_append_json_string(out, g_ptr_array_index(release->artists, i));
+    }
+
+    g_string_append(out, "],\"release_group_title\":");
+    output_append_json_string(out, release->group_title);
+
+    if (release->fuzzy_discid) {
+        g_string_append(out, ",\"fuzzy_match\":{\"discid\":");
+        output_append_json_string(out, release->fuzzy_discid);
+        g_string_append(out, ",\"distance\":");
+        output_append_int(out, release->fuzzy_distance, 0);
+        g_string_append_c(out, '}');
+    }
+
+    g_string_append(out, ",\"media\":");
+
+    if (release->media) {
+        g_string_append_c(out, '[');
+
+        for (guint i = 0; i < release->media->len; i++) {
+            if (i > 0)
+                g_string_append_c(out, ',');
+            medium_result_render_json(&g_array_index(release->media, MediumResult, i), out);
+        }
+
+        g_string_append_c(out, ']');
+    } else
+        g_string_append(out, "null");
+
+    g_string_append_c(out, '}');
+}
+
+
+/* One disc as a single line JSON object */
+void disc_result_render_json(const DiscResult *result, GString *out)
+{
+    g_string_append(out, "{\"discid\":");
+    output_append_json_string(out, result->discid);
+
+    if (result->device) {
+        g_string_append(out, ",\"device\":");
+        output_append_json_string(out, result->device);
+    }
+
+    g_string_append(out, ",\"result\":");
+    output_append_int(out, result->query_result, 0);
+    g_string_append(out, ",\"http_code\":");
+    output_append_int(out, result->http_code, 0);
+    g_string_append(out, ",\"error_message\":");
+    output_append_json_string(out, result->error_message);
+    g_string_append(out, ",\"failed_releases\":");
+    output_append_int(out, result->failed_releases, 0);
+    g_string_append(out, ",\"source\":");
+    if (result->cached)
+        g_string_append(out, result->prefetched ? "\"prefetch\"" : "\"cache\"");
+    else
+        g_string_append(out, result->offline ? "\"index\"" : "\"network\"");
+    g_string_append(out, ",\"timings\":{\"lookup_us\":");
+    output_append_int(out, result->lookup_time, 0);
+    g_string_append(out, "},\"releases\":");
+
+    if (result->releases) {
+        g_string_append_c(out, '[');
+
+        for (guint i = 0; i < result->releases->len; i++) {
+            if (i > 0)
+                g_string_append_c(out, ',');
+            release_result_render_json(&g_array_index(result->releases, ReleaseResult, i), out);
+        }
+
+        g_string_append_c(out, ']');
+    } else
+        g_string_append(out, "null");
+
+    g_string_append_c(out, '}');
+}
+
+
+/* A record for the disc as a whole, the text format starts with its drive and disc ID */
+void disc_result_render(const DiscResult *result, OutputFormat format, GString *out)
+{
+    if (format == OUTPUT_FORMAT_TEXT) {
+        if (result->device) {
+            g_string_append(out, "Device: ");
+            g_string_append(out, result->device);
+            g_string_append_c(out, '\n');
+        }
+
+        g_string_append(out, "DiscID: ");
+        g_string_append(out, result->discid);
+        g_string_append_c(out, '\n');
+        disc_result_render_text(result, out);
+    } else
+        disc_result_render_json(result, out);
+}
+
+
+gboolean output_format_from_string(const gchar *name, OutputFormat *format)
+{
+    if (name == NULL || g_strcmp0(name, "text") == 0)
+        *format = OUTPUT_FORMAT_TEXT;
+    else if (g_strcmp0(name, "json") == 0)
+        *format = OUTPUT_FORMAT_JSON;
+    else if (g_strcmp0(name, "ndjson") == 0)
+        *format = OUTPUT_FORMAT_NDJSON;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+
+void output_writer_init(OutputWriter *writer, FILE *stream, OutputFormat format, gboolean flush_records)
+{
+    writer->stream = stream;
+    writer->format = format;
+    writer->flush_records = flush_records;
+    writer->buffer = g_string_sized_new(flush_records ? 4096 : OUTPUT_BUFFER_SIZE + 4096);
+    writer->records = 0;
+}
+
+
+void output_writer_flush(OutputWriter *writer)
+{
+    fwrite(writer->buffer->str, 1, writer->buffer->len, writer->stream);
+    fflush(writer->stream);
+    g_string_truncate(writer->buffer, 0);
+}
+
+
+void output_writer_write(OutputWriter *writer, const DiscResult *result)
+{
+    if (writer->format == OUTPUT_FORMAT_JSON)
+        g_string_append(writer->buffer, writer->records == 0 ? "[\n" : ",\n");
+
+    disc_result_render(result, writer->format, writer->buffer);
+
+    if (writer->format == OUTPUT_FORMAT_NDJSON)
+        g_string_append_c(writer->buffer, '\n');
+
+    writer->records++;
+
+    if (writer->flush_records || writer->buffer->len >= OUTPUT_BUFFER_SIZE)
+        output_writer_flush(writer);
+}
+
+
+/* Close the JSON array if there is one and write out what is left */
+void output_writer_finish(OutputWriter *writer)
+{
+    if (writer->format == OUTPUT_FORMAT_JSON)
+        g_string_append(writer->buffer, writer->records == 0 ? "[]\n" : "\n]\n");
+
+    output_writer_flush(writer);
+    g_string_free(writer->buffer, TRUE);
+    writer->buffer = NULL;
+}
+
+
+/*
+ * Persistent disc cache
+ *
+ * Extracted results are kept in a single append-only file, keyed by disc ID.
+ * The file starts with a header and a fixed table of hash buckets, each
+ * holding the offset of the newest record in its chain. Records are only ever
+ * appended; an invalidation is a tombstone record shadowing the older ones.
+ * The file is mmap'd, so a hit is a hash, a short chain walk and a decode.
+ *
+ * Several processes can share the file: readers hold a shared flock() while
+ * walking a chain, writers an exclusive one while appending.
+ */
+
+#define CACHE_MAGIC "MBXDISC1"
+#define CACHE_VERSION 1
+#define CACHE_BUCKETS 65536
+#define CACHE_RECORD_MAGIC 0x4d42584du
+
+#define CACHE_RECORD_TOMBSTONE (1 << 0)
+#define CACHE_RECORD_PREFETCHED (1 << 1)
+
+#define CACHE_DEFAULT_TTL (30 * 24 * 3600)
+
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 bucket_count;
+    guint64 end;                /* where the next record gets appended */
+} CacheHeader;
+
+typedef struct {
+    guint32 magic;
+    guint32 flags;
+    guint64 next;               /* older record in the same bucket, 0 if none */
+    gint64 stored;              /* seconds since the epoch */
+    guint32 key_length;
+    guint32 payload_length;
+    /* followed by the key, then the payload, padded to 8 bytes */
+} CacheRecord;
+
+typedef struct {
+    gchar *path;
+    int fd;
+    guint8 *map;
+    gsize map_length;
+    gint64 ttl;                 /* in seconds, 0 if entries never expire */
+
+    GMutex lock;
+
+    guint hits;
+    guint misses;
+    guint expired;
+    guint prefetched;           /* entries stored for the other media of a release */
+    guint prefetch_hits;
+} DiscCache;
+
+
+guint32 cache_hash(const char *key)
+{
+    /* FNV-1a */
+    guint32 hash = 2166136261u;
+
+    for (; *key; key++) {
+        hash ^= (guint8)*key;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+gsize cache_data_start(void)
+{
+    return sizeof(CacheHeader) + CACHE_BUCKETS * sizeof(guint64);
+}
+
+
+/*
+ * Serialization of a DiscResult. Integers are stored in host byte order,
+ * strings as a length followed by the bytes; G_MAXUINT32 marks a NULL string.
+ */
+
+void cache_put_u32(GByteArray *buffer, guint32 value)
+{
+    g_byte_array_append(buffer, (const guint8 *)&value, sizeof(value));
+}
+
+
+void cache_put_string(GByteArray *buffer, const gchar *string)
+{
+    if (string == NULL) {
+        cache_put_u32(buffer, G_MAXUINT32);
+        return;
+    }
+
+    cache_put_u32(buffer, strlen(string));
+    g_byte_array_append(buffer, (const guint8 *)string, strlen(string));
+}
+
+
+typedef struct {
+    const guint8 *data;
+    gsize length;
+    gsize offset;
+    gboolean error;
+} CacheReader;
+
+
+guint32 cache_get_u32(CacheReader *reader)
+{
+    guint32 value = 0;
+
+    if (reader->error || reader->length - reader->offset < sizeof(value)) {
+        reader->error = TRUE;
+        return 0;
+    }
+
+    memcpy(&value, reader->data + reader->offset, sizeof(value));
+    reader->offset += sizeof(value);
+
+    return value;
+}
+
+
+gchar *cache_get_string(CacheReader *reader, Arena *arena)
+{
+    guint32 length = cache_get_u32(reader);
+    gchar *string;
+
+    if (reader->error || length == G_MAXUINT32)
+        return NULL;
+
+    if (reader->length - reader->offset < length) {
+        reader->error = TRUE;
+        return NULL;
+    }
+
+    string = arena_strndup(arena, (const gchar *)reader->data + reader->offset, length);
+    reader->offset += length;
+
+    return string;
+}
+
+
+GByteArray *disc_result_serialize(const DiscResult *result)
+{
+    GByteArray *buffer = g_byte_array_new();
+
+    cache_put_u32(buffer, result->query_result);
+    cache_put_u32(buffer, result->http_code);
+    cache_put_string(buffer, result->error_message);
+    cache_put_u32(buffer, result->releases->len);
+
+    for (guint i = 0; i < result->releases->len; i++) {
+        const ReleaseResult *release = &g_array_index(result->releases, ReleaseResult, i);
+
+        cache_put_string(buffer, release->id);
+        cache_put_u32(buffer, release->artists->len);
+        for (guint j = 0; j < release->artists->len; j++)
+            cache_put_string(buffer, g_ptr_array_index(release->artists, j));
+        cache_put_string(buffer, release->group_title);
+
+        cache_put_u32(buffer, release->media ? release->media->len : G_MAXUINT32);
+        if (release->media == NULL)
+            continue;
+
+        for (guint j = 0; j < release->media->len; j++) {
+            const MediumResult *medium = &g_array_index(release->media, MediumResult, j);
+
+            cache_put_string(buffer, medium->title);
+            cache_put_u32(buffer, medium->position);
+            cache_put_u32(buffer, medium->has_tracks);
+            cache_put_u32(buffer, medium->track_offset);
+            cache_put_u32(buffer, medium->compilation);
+            cache_put_u32(buffer, medium->tracks->len);
+
+            for (guint k = 0; k < medium->tracks->len; k++) {
+                const TrackResult *track = &g_array_index(medium->tracks, TrackResult, k);
+
+                cache_put_u32(buffer, track->position);
+                cache_put_u32(buffer, track->length);
+                cache_put_string(buffer, track->title);
+                cache_put_string(buffer, track->artist);
+            }
+        }
+    }
+
+    return buffer;
+}
+
+
+DiscResult *disc_result_deserialize(const char *discid, const guint8 *data, gsize length)
+{
+    CacheReader reader = { data, length, 0, FALSE };
+    DiscResult *result = disc_result_new(discid);
+    guint32 release_count;
+
+    result->query_result = cache_get_u32(&reader);
+    result->http_code = cache_get_u32(&reader);
+    result->error_message = cache_get_string(&reader, &result->strings);
+
+    release_count = cache_get_u32(&reader);
+    result->releases = g_array_new(FALSE, TRUE, sizeof(ReleaseResult));
+
+    for (guint i = 0; i < release_count && !reader.error; i++) {
+        ReleaseResult release = { 0 };
+        guint32 count;
+
+        release.id = cache_get_string(&reader, &result->strings);
+        release.artists = g_ptr_array_new();
+        count = cache_get_u32(&reader);
+        for (guint j = 0; j < count && !reader.error; j++)
+            g_ptr_array_add(release.artists, cache_get_string(&reader, &result->strings));
+        release.group_title = cache_get_string(&reader, &result->strings);
+
+        count = cache_get_u32(&reader);
+        if (count != G_MAXUINT32) {
+            release.media = g_array_new(FALSE, TRUE, sizeof(MediumResult));
+
+            for (guint j = 0; j < count && !reader.error; j++) {
+                MediumResult medium = { 0 };
+                guint32 track_count;
+
+                medium.title = cache_get_string(&reader, &result->strings);
+                medium.position = cache_get_u32(&reader);
+                medium.has_tracks = cache_get_u32(&reader);
+                medium.track_offset = cache_get_u32(&reader);
+                medium.compilation = cache_get_u32(&reader);
+                medium.tracks = g_array_new(FALSE, TRUE, sizeof(TrackResult));
+
+                track_count = cache_get_u32(&reader);
+                for (guint k = 0; k < track_count && !reader.error; k++) {
+                    TrackResult track;
+
+                    track.position = cache_get_u32(&reader);
+                    track.length = cache_get_u32(&reader);
+                    track.title = cache_get_string(&reader, &result->strings);
+                    track.artist = cache_get_string(&reader, &result->strings);
+
+                    g_array_append_val(medium.tracks, track);
+                }
+
+                g_array_append_val(release.media, medium);
+            }
+        }
+
+        g_array_append_val(result->releases, release);
+    }
+
+    if (reader.error || result->error_message == NULL) {
+        disc_result_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+
+/* Make sure the mapping covers the whole file. Called with the flock held. */
+gboolean disc_cache_remap(DiscCache *cache)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(cache->fd, &st) != 0)
+        return FALSE;
+
+    if ((gsize)st.st_size <= cache->map_length)
+        return TRUE;
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED)
+        return FALSE;
+
+    if (cache->map)
+        munmap(cache->map, cache->map_length);
+
+    cache->map = map;
+    cache->map_length = st.st_size;
+
+    return TRUE;
+}
+
+
+DiscCache *disc_cache_open(const gchar *path, gint64 ttl, GError **error)
+{
+    DiscCache *cache;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Cannot open cache '%s': %s", path, g_strerror(errno));
+        return NULL;
+    }
+
+    flock(fd, LOCK_EX);
+
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        /* A new cache, write the header and an empty bucket table */
+        CacheHeader header = { CACHE_MAGIC, CACHE_VERSION, CACHE_BUCKETS, cache_data_start() };
+
+        if (ftruncate(fd, cache_data_start()) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Cannot create cache '%s': %s", path, g_strerror(errno));
+            flock(fd, LOCK_UN);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    cache = g_new0(DiscCache, 1);
+    cache->path = g_strdup(path);
+    cache->fd = fd;
+    cache->ttl = ttl;
+    g_mutex_init(&cache->lock);
+
+    if (!disc_cache_remap(cache) || cache->map_length < cache_data_start()
+        || memcmp(cache->map, CACHE_MAGIC, 8) != 0
+        || ((CacheHeader *)cache->map)->version != CACHE_VERSION
+        || ((CacheHeader *)cache->map)->bucket_count != CACHE_BUCKETS) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "'%s' is not a disc cache", path);
+        flock(fd, LOCK_UN);
+        if (cache->map)
+            munmap(cache->map, cache->map_length);
+        close(fd);
+        g_mutex_clear(&cache->lock);
+        g_free(cache->path);
+        g_free(cache);
+        return NULL;
+    }
+
+    flock(fd, LOCK_UN);
+
+    return cache;
+}
+
+
+void disc_cache_close(DiscCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    munmap(cache->map, cache->map_length);
+    close(cache->fd);
+    g_mutex_clear(&cache->lock);
+    g_free(cache->path);
+    g_free(cache);
+}
+
+
+/* Returns the newest record for the key, or NULL. Called with the flock held. */
+const CacheRecord *disc_cache_find(DiscCache *cache, const char *discid)
+{
+    CacheHeader *header;
+    guint64 *buckets;
+    guint64 offset;
+    gsize key_length = strlen(discid);
+
+    // Another process may have appended since we mapped the file
+    if (((CacheHeader *)cache->map)->end > cache->map_length && !disc_cache_remap(cache))
+        return NULL;
+
+    header = (CacheHeader *)cache->map;
+    buckets = (guint64 *)(cache->map + sizeof(CacheHeader));
+    offset = buckets[cache_hash(discid) % CACHE_BUCKETS];
+
+    while (offset != 0) {
+        const CacheRecord *record;
+
+        if (offset < cache_data_start() || offset + sizeof(CacheRecord) > header->end)
+            return NULL;
+
+        record = (const CacheRecord *)(cache->map + offset);
+
+        if (record->magic != CACHE_RECORD_MAGIC
+            || offset + sizeof(CacheRecord) + record->key_length + record->payload_length > header->end)
+            return NULL;
+
+        if (record->key_length == key_length && memcmp(record + 1, discid, key_length) == 0)
+            return record;
+
+        offset = record->next;
+    }
+
+    return NULL;
+}
+
+
+DiscResult *disc_cache_lookup(DiscCache *cache, const char *discid)
+{
+    const CacheRecord *record;
+    DiscResult *result = NULL;
+
+    g_mutex_lock(&cache->lock);
+    flock(cache->fd, LOCK_SH);
+
+    record = disc_cache_find(cache, discid);
+    if (record && !(record->flags & CACHE_RECORD_TOMBSTONE)) {
+        if (cache->ttl > 0 && g_get_real_time() / G_USEC_PER_SEC - record->stored > cache->ttl) {
+            cache->expired++;
+        } else {
+            const guint8 *payload = (const guint8 *)(record + 1) + record->key_length;
+
+            result = disc_result_deserialize(discid, payload, record->payload_length);
+            if (result)
+                result->prefetched = (record->flags & CACHE_RECORD_PREFETCHED) != 0;
+        }
+    }
+
+    flock(cache->fd, LOCK_UN);
+
+    if (result) {
+        cache->hits++;
+        cache->prefetch_hits += result->prefetched;
+    } else
+        cache->misses++;
+
+    g_mutex_unlock(&cache->lock);
+
+    return result;
+}
+
+
+gboolean disc_cache_append(DiscCache *cache, const char *discid, guint32 flags, const guint8 *payload, gsize payload_length)
+{
+    CacheRecord record = { 0 };
+    GByteArray *buffer = g_byte_array_new();
+    static const guint8 padding[8] = { 0 };
+    gboolean success = FALSE;
+
+    record.magic = CACHE_RECORD_MAGIC;
+    record.flags = flags;
+    record.stored = g_get_real_time() / G_USEC_PER_SEC;
+    record.key_length = strlen(discid);
+    record.payload_length = payload_length;
+
+    g_mutex_lock(&cache->lock);
+    flock(cache->fd, LOCK_EX);
+
+    CacheHeader *header = (CacheHeader *)cache->map;
+    guint64 *buckets = (guint64 *)(cache->map + sizeof(CacheHeader));
+    guint32 bucket = cache_hash(discid) % CACHE_BUCKETS;
+    guint64 offset = header->end;
+
+    record.next = buckets[bucket];
+
+    g_byte_array_append(buffer, (const guint8 *)&record, sizeof(record));
+    g_byte_array_append(buffer, (const guint8 *)discid, record.key_length);
+    g_byte_array_append(buffer, payload, payload_length);
+    g_byte_array_append(buffer, padding, (8 - buffer->len % 8) % 8);
+
+    /* Write the record first, so readers never see a bucket pointing at nothing */
+    if (pwrite(cache->fd, buffer->data, buffer->len, offset) == (gssize)buffer->len) {
+        buckets[bucket] = offset;
+        header->end = offset + buffer->len;
+        success = TRUE;
+    }
+
+    flock(cache->fd, LOCK_UN);
+    g_mutex_unlock(&cache->lock);
+
+    g_byte_array_free(buffer, TRUE);
+
+    return success;
+}
+
+
+/* Whether the disc has an entry that would be returned by disc_cache_lookup() */
+gboolean disc_cache_contains(DiscCache *cache, const char *discid)
+{
+    const CacheRecord *record;
+    gboolean found;
+
+    g_mutex_lock(&cache->lock);
+    flock(cache->fd, LOCK_SH);
+
+    record = disc_cache_find(cache, discid);
+    found = record && !(record->flags & CACHE_RECORD_TOMBSTONE) &&
+            (cache->ttl == 0 || g_get_real_time() / G_USEC_PER_SEC - record->stored <= cache->ttl);
+
+    flock(cache->fd, LOCK_UN);
+    g_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+
+gboolean disc_cache_store(DiscCache *cache, const DiscResult *result)
+{
+    GByteArray *payload = disc_result_serialize(result);
+    guint32 flags = result->prefetched ? CACHE_RECORD_PREFETCHED : 0;
+    gboolean success = disc_cache_append(cache, result->discid, flags, payload->data, payload->len);
+
+    g_byte_array_free(payload, TRUE);
+
+    if (success && result->prefetched) {
+        g_mutex_lock(&cache->lock);
+        cache->prefetched++;
+        g_mutex_unlock(&cache->lock);
+    }
+
+    return success;
+}
+
+
+gboolean disc_cache_invalidate(DiscCache *cache, const char *discid)
+{
+    return disc_cache_append(cache, discid, CACHE_RECORD_TOMBSTONE, NULL, 0);
+}
+
+
+void disc_cache_print_stats(DiscCache *cache, FILE *stream)
+{
+    g_mutex_lock(&cache->lock);
+    fprintf(stream, "Cache: %u hit(s), %u miss(es), %u expired\n", cache->hits, cache->misses, cache->expired);
+    fprintf(stream, "Prefetched media: %u stored, %u hit(s)\n", cache->prefetched, cache->prefetch_hits);
+    g_mutex_unlock(&cache->lock);
+}
+
+
+/*
+ * Offline disc index
+ *
+ * Built from a MusicBrainz JSON dump (one release per line) by
+ * --import-dump, and consulted by cd_lookup() before it goes to the network.
+ * The file is a header, the release records, a string table and the disc
+ * IDs, sorted so they can be binary searched. A release record is laid out
+ * contiguously:
+ *
+ *   IndexRelease, guint32 artists[], IndexMedium media[], IndexTrack tracks[]
+ *
+ * with the tracks of all media one after the other. Strings are referred to
+ * by their offset in the string table. Only the media that have a disc ID
+ * are kept. The file is mapped read-only and results point straight into
+ * the mapping, so the index has to outlive them.
+ *
+ * The TOCs of the discs follow, for fuzzy matching. They are bucketed by
+ * track count, and sorted by lead-out within a bucket; each bucket holds
+ * its lead-outs, its disc numbers and its track offsets as three separate
+ * arrays, so the search only touches what it compares.
+ */
+
+#define INDEX_MAGIC "MBXINDX1"
+#define INDEX_VERSION 2
+#define INDEX_NO_STRING G_MAXUINT32
+#define INDEX_DISCID_LENGTH 28
+#define INDEX_TOC_BUCKETS 100      /* by track count, 1 to 99 */
+
+#define INDEX_MEDIUM_HAS_TRACKS (1 << 0)
+#define INDEX_MEDIUM_COMPILATION (1 << 1)
+
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 disc_count;
+    guint64 releases_offset;
+    guint64 strings_offset;
+    guint64 discs_offset;
+    guint64 tocs_offset;
+    guint64 size;
+} IndexHeader;
+
+typedef struct {
+    guint32 id;
+    guint32 group_title;        /* INDEX_NO_STRING if the release has no release group */
+    guint32 artist_count;
+    guint32 medium_count;
+} IndexRelease;
+
+typedef struct {
+    guint32 title;
+    gint32 position;
+    gint32 track_offset;
+    guint32 track_count;
+    guint32 flags;
+} IndexMedium;
+
+typedef struct {
+    gint32 position;
+    gint32 length;              /* in milliseconds */
+    guint32 title;
+    guint32 artist;             /* INDEX_NO_STRING if the recording has no artist credit */
+} IndexTrack;
+
+typedef struct {
+    gchar discid[INDEX_DISCID_LENGTH];
+    guint32 medium;             /* among the media kept for the release */
+    guint64 release;            /* offset of the IndexRelease from releases_offset */
+} IndexDisc;
+
+typedef struct {
+    guint64 offset;             /* from tocs_offset, to guint32 leadouts[count], discs[count], offsets[count][tracks] */
+    guint32 count;
+    guint32 reserved;
+} IndexTocBucket;
+
+typedef struct {
+    GMappedFile *file;
+    const guint8 *releases;
+    gsize releases_size;
+    const gchar *strings;
+    gsize strings_size;
+    const IndexDisc *discs;
+    guint32 disc_count;
+    const guint8 *tocs;
+    const IndexTocBucket *toc_buckets;
+} OfflineIndex;
+
+static OfflineIndex *offline_index = NULL;
+
+
+guint32 *index_release_artists(IndexRelease *release)
+{
+    return (guint32 *)(release + 1);
+}
+
+
+IndexMedium *index_release_media(IndexRelease *release)
+{
+    return (IndexMedium *)(index_release_artists(release) + release->artist_count);
+}
+
+
+IndexTrack *index_release_tracks(IndexRelease *release)
+{
+    return (IndexTrack *)(index_release_media(release) + release->medium_count);
+}
+
+
+gsize index_release_size(IndexRelease *release)
+{
+    IndexMedium *media = index_release_media(release);
+    gsize track_count = 0;
+
+    for (guint32 i = 0; i < release->medium_count; i++)
+        track_count += media[i].track_count;
+
+    return (guint8 *)(index_release_tracks(release) + track_count) - (guint8 *)release;
+}
+
+
+OfflineIndex *offline_index_open(const char *path, GError **error)
+{
+    OfflineIndex *index;
+    GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+    const IndexHeader *header;
+    gsize length;
+
+    if (file == NULL)
+        return NULL;
+
+    header = (const IndexHeader *)g_mapped_file_get_contents(file);
+    length = g_mapped_file_get_length(file);
+
+    if (length < sizeof(IndexHeader) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != INDEX_VERSION || header->size != length
+        || header->releases_offset < sizeof(IndexHeader) || header->releases_offset > header->strings_offset
+        || header->strings_offset > header->discs_offset || header->discs_offset % 8 != 0
+        || header->discs_offset + (guint64)header->disc_count * sizeof(IndexDisc) != header->tocs_offset
+        || header->tocs_offset + INDEX_TOC_BUCKETS * sizeof(IndexTocBucket) > length) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a disc index", path);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+
+    const IndexTocBucket *buckets = (const IndexTocBucket *)((const guint8 *)header + header->tocs_offset);
+
+    for (guint32 tracks = 0; tracks < INDEX_TOC_BUCKETS; tracks++) {
+        if (header->tocs_offset + buckets[tracks].offset + (guint64)buckets[tracks].count * (2 + tracks) * sizeof(guint32) > length) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s has a damaged TOC table", path);
+            g_mapped_file_unref(file);
+            return NULL;
+        }
+    }
+
+    index = g_new0(OfflineIndex, 1);
+    index->file = file;
+    index->releases = (const guint8 *)header + header->releases_offset;
+    index->releases_size = header->strings_offset - header->releases_offset;
+    index->strings = (const gchar *)header + header->strings_offset;
+    index->strings_size = header->discs_offset - header->strings_offset;
+    index->discs = (const IndexDisc *)((const guint8 *)header + header->discs_offset);
+    index->disc_count = header->disc_count;
+    index->tocs = (const guint8 *)header + header->tocs_offset;
+    index->toc_buckets = buckets;
+
+    return index;
+}
+
+
+void offline_index_close(OfflineIndex *index)
+{
+    g_mapped_file_unref(index->file);
+    g_free(index);
+}
+
+
+gchar *offline_index_string(const OfflineIndex *index, guint32 offset)
+{
+    if (offset == INDEX_NO_STRING || offset >= index->strings_size)
+        return NULL;
+
+    return (gchar *)index->strings + offset;
+}
+
+
+void offline_index_append_medium(const OfflineIndex *index, IndexRelease *release, guint32 medium_index, GArray *media)
+{
+    IndexMedium *medium = &index_release_media(release)[medium_index];
+    IndexTrack *track = index_release_tracks(release);
+    MediumResult result = { 0 };
+
+    for (guint32 i = 0; i < medium_index; i++)
+        track += index_release_media(release)[i].track_count;
+
+    result.title = offline_index_string(index, medium->title);
+    result.position = medium->position;
+    result.has_tracks = (medium->flags & INDEX_MEDIUM_HAS_TRACKS) != 0;
+    result.track_offset = medium->track_offset;
+    result.compilation = (medium->flags & INDEX_MEDIUM_COMPILATION) != 0;
+    result.tracks = g_array_sized_new(FALSE, TRUE, sizeof(TrackResult), medium->track_count);
+
+    for (guint32 i = 0; i < medium->track_count; i++, track++) {
+        TrackResult track_result;
+
+        track_result.position = track->position;
+        track_result.length = track->length;
+        track_result.title = offline_index_string(index, track->title);
+        track_result.artist = offline_index_string(index, track->artist);
+
+        g_array_append_val(result.tracks, track_result);
+    }
+
+    g_array_append_val(media, result);
+}
+
+
+/* The first entry for the disc ID, or count if it isn't there */
+guint32 index_find_disc(const IndexDisc *discs, guint32 count, const char *discid)
+{
+    guint32 low = 0, high = count;
+
+    while (low < high) {
+        guint32 middle = low + (high - low) / 2;
+
+        if (memcmp(discs[middle].discid, discid, INDEX_DISCID_LENGTH) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low < count && memcmp(discs[low].discid, discid, INDEX_DISCID_LENGTH) == 0)
+        return low;
+
+    return count;
+}
+
+
+/* Append the releases of the disc whose first entry is first, returns how many */
+guint offline_index_append_releases(const OfflineIndex *index, guint32 first, GArray *releases)
+{
+    const IndexDisc *discs = index->discs;
+    const gchar *discid = discs[first].discid;
+    guint32 i = first;
+    guint count = 0;
+
+    // Entries are sorted by release within a disc ID, and by medium within a release
+    while (i < index->disc_count && memcmp(discs[i].discid, discid, INDEX_DISCID_LENGTH) == 0) {
+        guint64 offset = discs[i].release;
+        IndexRelease *release;
+        ReleaseResult release_result = { 0 };
+
+        if (offset + sizeof(IndexRelease) > index->releases_size)
+            break;
+
+        release = (IndexRelease *)(index->releases + offset);
+
+        release_result.id = offline_index_string(index, release->id);
+        release_result.group_title = offline_index_string(index, release->group_title);
+        release_result.artists = g_ptr_array_sized_new(release->artist_count);
+        release_result.media = g_array_new(FALSE, TRUE, sizeof(MediumResult));
+
+        for (guint32 j = 0; j < release->artist_count; j++)
+            g_ptr_array_add(release_result.artists, offline_index_string(index, index_release_artists(release)[j]));
+
+        for (; i < index->disc_count && discs[i].release == offset
+               && memcmp(discs[i].discid, discid, INDEX_DISCID_LENGTH) == 0; i++) {
+            if (discs[i].medium < release->medium_count)
+                offline_index_append_medium(index, release, discs[i].medium, release_result.media);
+        }
+
+        g_array_append_val(releases, release_result);
+        count++;
+    }
+
+    return count;
+}
+
+
+/* Returns NULL if the disc isn't in the index */
+DiscResult *offline_index_lookup(const OfflineIndex *index, const char *discid)
+{
+    guint32 first;
+    DiscResult *result;
+
+    if (strlen(discid) != INDEX_DISCID_LENGTH)
+        return NULL;
+
+    first = index_find_disc(index->discs, index->disc_count, discid);
+    if (first == index->disc_count)
+        return NULL;
+
+    // Look just like a successful query, so the output doesn't depend on where it came from
+    result = disc_result_new(discid);
+    result->query_result = eQuery_Success;
+    result->http_code = 200;
+    result->offline = TRUE;
+    result->releases = g_array_new(FALSE, TRUE, sizeof(ReleaseResult));
+
+    offline_index_append_releases(index, first, result->releases);
+
+    return result;
+}
+
+
+/*
+ * Fuzzy TOC matching
+ *
+ * Another pressing of the same disc often has a slightly different TOC, and
+ * so a different disc ID. When the exact lookup finds nothing, the TOCs in
+ * the index with the same track count and a lead-out within the tolerance
+ * are compared track by track, and the closest ones are returned instead.
+ */
+
+#define FUZZY_DEFAULT_TOLERANCE 75      /* sectors, one second */
+#define FUZZY_MAX_TOLERANCE (75 * 60)
+#define FUZZY_MAX_CANDIDATES 5
+
+typedef struct {
+    guint32 disc;               /* first entry of the disc in the index */
+    gint64 distance;
+} FuzzyCandidate;
+
+static guint32 fuzzy_tolerance = FUZZY_DEFAULT_TOLERANCE;
+
+
+/*
+ * Sum of the differences between two offset vectors, or -1 if any track is
+ * more than tolerance sectors off. Offsets are below 2^31, so the
+ * differences fit in signed 32-bit lanes.
+ */
+gint64 toc_distance(const guint32 *a, const guint32 *b, guint32 count, guint32 tolerance)
+{
+    gint64 distance = 0;
+    guint32 i = 0;
+
+#if defined(__AVX2__)
+    const __m256i limit8 = _mm256_set1_epi32(tolerance);
+    __m256i sum8 = _mm256_setzero_si256();
+    gint32 lanes8[8];
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i difference = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                               _mm256_loadu_si256((const __m256i *)(b + i))));
+
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(difference, limit8)))
+            return -1;
+
+        sum8 = _mm256_add_epi32(sum8, difference);
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes8, sum8);
+    for (int lane = 0; lane < 8; lane++)
+        distance += lanes8[lane];
+#endif
+
+#if defined(__SSE2__)
+    const __m128i limit4 = _mm_set1_epi32(tolerance);
+    __m128i sum4 = _mm_setzero_si128();
+    gint32 lanes4[4];
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i difference = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i sign = _mm_srai_epi32(difference, 31);
+
+        // SSE2 has no abs for 32-bit lanes
+        difference = _mm_sub_epi32(_mm_xor_si128(difference, sign), sign);
+
+        if (_mm_movemask_epi8(_mm_cmpgt_epi32(difference, limit4)))
+            return -1;
+
+        sum4 = _mm_add_epi32(sum4, difference);
+    }
+
+    _mm_storeu_si128((__m128i *)lanes4, sum4);
+    for (int lane = 0; lane < 4; lane++)
+        distance += lanes4[lane];
+#endif
+
+    for (; i < count; i++) {
+        guint32 difference = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+        if (difference > tolerance)
+            return -1;
+
+        distance += difference;
+    }
+
+    return distance;
+}
+
+
+/*
+ * Add the releases of the discs whose TOC is closest to toc to result, the
+ * best match first. Returns the number of discs that matched.
+ */
+guint offline_index_fuzzy_lookup(const OfflineIndex *index, const DiscToc *toc, guint32 tolerance, DiscResult *result)
+{
+    FuzzyCandidate candidates[FUZZY_MAX_CANDIDATES];
+    const IndexTocBucket *bucket;
+    const guint32 *leadouts, *discs, *offsets;
+    guint32 tracks = toc->track_count;
+    guint32 lowest = toc->leadout > tolerance ? toc->leadout - tolerance : 0;
+    guint32 low = 0, high;
+    guint found = 0;
+
+    if (tracks == 0 || tracks >= INDEX_TOC_BUCKETS)
+        return 0;
+
+    bucket = &index->toc_buckets[tracks];
+    leadouts = (const guint32 *)(index->tocs + bucket->offset);
+    discs = leadouts + bucket->count;
+    offsets = discs + bucket->count;
+
+    // The first lead-out that is close enough
+    high = bucket->count;
+    while (low < high) {
+        guint32 middle = low + (high - low) / 2;
+
+        if (leadouts[middle] < lowest)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    for (guint32 i = low; i < bucket->count && leadouts[i] <= (guint64)toc->leadout + tolerance; i++) {
+        gint64 distance = toc_distance(toc->offsets, offsets + (gsize)i * tracks, tracks, tolerance);
+        guint position;
+
+        if (distance < 0)
+            continue;
+
+        distance += leadouts[i] > toc->leadout ? leadouts[i] - toc->leadout : toc->leadout - leadouts[i];
+
+        // Keep the best few, in order
+        for (position = found; position > 0 && candidates[position - 1].distance > distance; position--) {
+            if (position < FUZZY_MAX_CANDIDATES)
+                candidates[position] = candidates[position - 1];
+        }
+
+        if (position < FUZZY_MAX_CANDIDATES) {
+            candidates[position].disc = discs[i];
+            candidates[position].distance = distance;
+            found = MIN(found + 1, FUZZY_MAX_CANDIDATES);
+        }
+    }
+
+    if (found == 0)
+        return 0;
+
+    if (result->releases == NULL)
+        result->releases = g_array_new(FALSE, TRUE, sizeof(ReleaseResult));
+
+    result->offline = TRUE;
+
+    for (guint i = 0; i < found; i++) {
+        guint first = result->releases->len;
+        gchar *discid;
+
+        if (candidates[i].disc >= index->disc_count)
+            continue;
+
+        discid = arena_strndup(&result->strings, index->discs[candidates[i].disc].discid, INDEX_DISCID_LENGTH);
+        offline_index_append_releases(index, candidates[i].disc, result->releases);
+
+        for (guint j = first; j < result->releases->len; j++) {
+            g_array_index(result->releases, ReleaseResult, j).fuzzy_discid = discid;
+            g_array_index(result->releases, ReleaseResult, j).fuzzy_distance = candidates[i].distance;
+        }
+    }
+
+    return found;
+}
+
+
+/*
+ * Dump import
+ *
+ * The main thread reads the dump line by line and hands each line to a pool
+ * of parser threads, never letting more than a few lines per thread queue
+ * up. A parsed release is written with its strings and the TOCs of its
+ * discs to temporary files, only the disc IDs are kept in memory. Once the
+ * dump is read, the disc IDs are sorted, the TOCs bucketed, and everything
+ * is copied into the index file.
+ */
+
+#define IMPORT_QUEUED_PER_WORKER 64
+
+typedef struct {
+    gchar discid[INDEX_DISCID_LENGTH];
+    guint32 track_count;
+    guint32 leadout;
+    /* followed by guint32 offsets[track_count] */
+} DumpToc;
+
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    guint queued;               /* lines handed to the pool and not parsed yet */
+
+    FILE *releases;
+    FILE *strings;
+    FILE *tocs;                 /* DumpToc */
+    guint64 releases_size;
+    guint64 strings_size;
+    GArray *discs;              /* IndexDisc */
+
+    guint release_count;
+    guint skipped;
+    gboolean failed;
+} DumpImport;
+
+
+JsonObject *dump_get_object(JsonObject *object, const gchar *name)
+{
+    JsonNode *node = object ? json_object_get_member(object, name) : NULL;
+
+    return node && JSON_NODE_HOLDS_OBJECT(node) ? json_node_get_object(node) : NULL;
+}
+
+
+JsonArray *dump_get_array(JsonObject *object, const gchar *name)
+{
+    JsonNode *node = object ? json_object_get_member(object, name) : NULL;
+
+    return node && JSON_NODE_HOLDS_ARRAY(node) ? json_node_get_array(node) : NULL;
+}
+
+
+const gchar *dump_get_string(JsonObject *object, const gchar *name)
+{
+    JsonNode *node = object ? json_object_get_member(object, name) : NULL;
+
+    if (node == NULL || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_STRING)
+        return NULL;
+
+    return json_node_get_string(node);
+}
+
+
+gint64 dump_get_int(JsonObject *object, const gchar *name, gint64 fallback)
+{
+    JsonNode *node = object ? json_object_get_member(object, name) : NULL;
+
+    if (node == NULL || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_INT64)
+        return fallback;
+
+    return json_node_get_int(node);
+}
+
+
+JsonObject *dump_array_get_object(JsonArray *array, guint i)
+{
+    JsonNode *node = json_array_get_element(array, i);
+
+    return JSON_NODE_HOLDS_OBJECT(node) ? json_node_get_object(node) : NULL;
+}
+
+
+/* Strings are written with the record, offsets are relative to its own table until then */
+guint32 dump_add_string(GByteArray *strings, const gchar *string)
+{
+    guint32 offset = strings->len;
+
+    if (string == NULL)
+        return INDEX_NO_STRING;
+
+    g_byte_array_append(strings, (const guint8 *)string, strlen(string) + 1);
+
+    return offset;
+}
+
+
+/* The first artist of a credit, as the network path does it */
+JsonObject *dump_credited_artist(JsonArray *artist_credit)
+{
+    if (artist_credit == NULL || json_array_get_length(artist_credit) == 0)
+        return NULL;
+
+    return dump_get_object(dump_array_get_object(artist_credit, 0), "artist");
+}
+
+
+/* Discs without a usable TOC can still be found by their disc ID */
+void dump_add_toc(GByteArray *tocs, const gchar *discid, JsonObject *disc)
+{
+    JsonArray *offsets = dump_get_array(disc, "offsets");
+    DumpToc toc;
+
+    if (offsets == NULL || json_array_get_length(offsets) == 0 || json_array_get_length(offsets) >= INDEX_TOC_BUCKETS)
+        return;
+
+    memcpy(toc.discid, discid, INDEX_DISCID_LENGTH);
+    toc.track_count = json_array_get_length(offsets);
+    toc.leadout = dump_get_int(disc, "sectors", 0);
+
+    g_byte_array_append(tocs, (const guint8 *)&toc, sizeof(toc));
+
+    for (guint32 i = 0; i < toc.track_count; i++) {
+        JsonNode *node = json_array_get_element(offsets, i);
+        guint32 offset = JSON_NODE_HOLDS_VALUE(node) ? json_node_get_int(node) : 0;
+
+        g_byte_array_append(tocs, (const guint8 *)&offset, sizeof(offset));
+    }
+}
+
+
+/*
+ * Turn one release of the dump into an index record. Returns FALSE if none
+ * of its media has a disc ID, in which case there is nothing to index.
+ */
+gboolean dump_build_release(JsonObject *release, GByteArray *record, GByteArray *strings, GArray *discs, GByteArray *tocs)
+{
+    JsonArray *media = dump_get_array(release, "media");
+    JsonArray *artist_credit = dump_get_array(release, "artist-credit");
+    JsonObject *release_group = dump_get_object(release, "release-group");
+    GPtrArray *kept_media = g_ptr_array_new();
+    GByteArray *tracks = g_byte_array_new();
+    IndexRelease header = { 0 };
+
+    for (guint i = 0; media && i < json_array_get_length(media); i++) {
+        JsonObject *medium = dump_array_get_object(media, i);
+        JsonArray *medium_discs = dump_get_array(medium, "discs");
+
+        if (medium_discs && json_array_get_length(medium_discs) > 0)
+            g_ptr_array_add(kept_media, medium);
+    }
+
+    if (kept_media->len == 0 || dump_get_string(release, "id") == NULL) {
+        g_ptr_array_free(kept_media, TRUE);
+        g_byte_array_free(tracks, TRUE);
+        return FALSE;
+    }
+
+    header.id = dump_add_string(strings, dump_get_string(release, "id"));
+    header.group_title = INDEX_NO_STRING;
+    header.artist_count = artist_credit ? json_array_get_length(artist_credit) : 0;
+    header.medium_count = kept_media->len;
+
+    if (release_group) {
+        const gchar *title = dump_get_string(release_group, "title");
+
+        header.group_title = dump_add_string(strings, title ? title : "");
+    }
+
+    g_byte_array_append(record, (const guint8 *)&header, sizeof(header));
+
+    for (guint i = 0; i < header.artist_count; i++) {
+        const gchar *name = dump_get_string(dump_get_object(dump_array_get_object(artist_credit, i), "artist"), "name");
+        guint32 artist = dump_add_string(strings, name ? name : "");
+
+        g_byte_array_append(record, (const guint8 *)&artist, sizeof(artist));
+    }
+
+    for (guint i = 0; i < kept_media->len; i++) {
+        JsonObject *medium = g_ptr_array_index(kept_media, i);
+        JsonArray *medium_tracks = dump_get_array(medium, "tracks");
+        JsonArray *medium_discs = dump_get_array(medium, "discs");
+        const gchar *title = dump_get_string(medium, "title");
+        GHashTable *artists = g_hash_table_new(g_str_hash, g_str_equal);
+        IndexMedium index_medium = { 0 };
+
+        index_medium.title = dump_add_string(strings, title ? title : "");
+        index_medium.position = dump_get_int(medium, "position", 0);
+        index_medium.track_offset = dump_get_int(medium, "track-offset", 0);
+        index_medium.track_count = medium_tracks ? json_array_get_length(medium_tracks) : 0;
+        index_medium.flags = medium_tracks ? INDEX_MEDIUM_HAS_TRACKS : 0;
+
+        for (guint j = 0; j < index_medium.track_count; j++) {
+            JsonObject *track = dump_array_get_object(medium_tracks, j);
+            JsonObject *recording = dump_get_object(track, "recording");
+            JsonObject *artist = recording ? dump_credited_artist(dump_get_array(recording, "artist-credit")) : NULL;
+            const gchar *track_title = dump_get_string(recording ? recording : track, "title");
+            IndexTrack index_track;
+
+            index_track.position = dump_get_int(track, "position", 0);
+            index_track.length = dump_get_int(track, "length", 0);
+            index_track.title = dump_add_string(strings, track_title ? track_title : "");
+            index_track.artist = INDEX_NO_STRING;
+
+            if (artist) {
+                const gchar *artist_id = dump_get_string(artist, "id");
+                const gchar *artist_name = dump_get_string(artist, "name");
+
+                index_track.artist = dump_add_string(strings, artist_name ? artist_name : "");
+                g_hash_table_add(artists, (gpointer)(artist_id ? artist_id : artist_name ? artist_name : ""));
+            }
+
+            g_byte_array_append(tracks, (const guint8 *)&index_track, sizeof(index_track));
+        }
+
+        // Same rule as extract_release(): several different artists make a compilation
+        if (g_hash_table_size(artists) > 1)
+            index_medium.flags |= INDEX_MEDIUM_COMPILATION;
+
+        g_hash_table_destroy(artists);
+
+        g_byte_array_append(record, (const guint8 *)&index_medium, sizeof(index_medium));
+
+        for (guint j = 0; j < json_array_get_length(medium_discs); j++) {
+            const gchar *discid = dump_get_string(dump_array_get_object(medium_discs, j), "id");
+            IndexDisc disc = { 0 };
+
+            if (discid == NULL || strlen(discid) != INDEX_DISCID_LENGTH)
+                continue;
+
+            memcpy(disc.discid, discid, INDEX_DISCID_LENGTH);
+            disc.medium = i;
+            g_array_append_val(discs, disc);
+
+            dump_add_toc(tocs, discid, dump_array_get_object(medium_discs, j));
+        }
+    }
+
+    g_byte_array_append(record, tracks->data, tracks->len);
+
+    g_ptr_array_free(kept_media, TRUE);
+    g_byte_array_free(tracks, TRUE);
+
+    return TRUE;
+}
+
+
+guint32 dump_relocate(guint32 offset, guint32 base)
+{
+    return offset == INDEX_NO_STRING ? offset : offset + base;
+}
+
+
+/* Point a record built by dump_build_release() at where its strings ended up */
+void dump_relocate_release(IndexRelease *release, guint32 base)
+{
+    IndexMedium *media = index_release_media(release);
+    IndexTrack *tracks = index_release_tracks(release);
+    guint32 track_count = 0;
+
+    release->id = dump_relocate(release->id, base);
+    release->group_title = dump_relocate(release->group_title, base);
+
+    for (guint32 i = 0; i < release->artist_count; i++)
+        index_release_artists(release)[i] = dump_relocate(index_release_artists(release)[i], base);
+
+    for (guint32 i = 0; i < release->medium_count; i++) {
+        media[i].title = dump_relocate(media[i].title, base);
+        track_count += media[i].track_count;
+    }
+
+    for (guint32 i = 0; i < track_count; i++) {
+        tracks[i].title = dump_relocate(tracks[i].title, base);
+        tracks[i].artist = dump_relocate(tracks[i].artist, base);
+    }
+}
+
+
+void dump_import_worker(gpointer data, gpointer user_data)
+{
+    gchar *line = data;
+    DumpImport *import = user_data;
+    JsonParser *parser = json_parser_new();
+    GByteArray *record = g_byte_array_new();
+    GByteArray *strings = g_byte_array_new();
+    GArray *discs = g_array_new(FALSE, FALSE, sizeof(IndexDisc));
+    GByteArray *tocs = g_byte_array_new();
+    gboolean indexed = FALSE;
+
+    if (json_parser_load_from_data(parser, line, -1, NULL)) {
+        JsonNode *root = json_parser_get_root(parser);
+
+        if (root && JSON_NODE_HOLDS_OBJECT(root))
+            indexed = dump_build_release(json_node_get_object(root), record, strings, discs, tocs);
+    }
+
+    g_mutex_lock(&import->lock);
+
+    if (!indexed) {
+        import->skipped++;
+    } else if (import->strings_size + strings->len >= INDEX_NO_STRING) {
+        // String offsets are 32 bits
+        import->failed = TRUE;
+    } else {
+        dump_relocate_release((IndexRelease *)record->data, import->strings_size);
+
+        for (guint i = 0; i < discs->len; i++)
+            g_array_index(discs, IndexDisc, i).release = import->releases_size;
+
+        if (fwrite(record->data, 1, record->len, import->releases) != record->len
+            || fwrite(strings->data, 1, strings->len, import->strings) != strings->len
+            || fwrite(tocs->data, 1, tocs->len, import->tocs) != tocs->len)
+            import->failed = TRUE;
+
+        import->releases_size += record->len;
+        import->strings_size += strings->len;
+        g_array_append_vals(import->discs, discs->data, discs->len);
+        import->release_count++;
+    }
+
+    import->queued--;
+    g_cond_signal(&import->cond);
+
+    g_mutex_unlock(&import->lock);
+
+    g_byte_array_free(tocs, TRUE);
+    g_array_free(discs, TRUE);
+    g_byte_array_free(strings, TRUE);
+    g_byte_array_free(record, TRUE);
+    g_object_unref(parser);
+    g_free(line);
+}
+
+
+gint compare_index_disc(gconstpointer a, gconstpointer b)
+{
+    const IndexDisc *disc_a = a;
+    const IndexDisc *disc_b = b;
+    int result = memcmp(disc_a->discid, disc_b->discid, INDEX_DISCID_LENGTH);
+
+    if (result != 0)
+        return result;
+
+    if (disc_a->release != disc_b->release)
+        return disc_a->release < disc_b->release ? -1 : 1;
+
+    return disc_a->medium < disc_b->medium ? -1 : disc_a->medium > disc_b->medium;
+}
+
+
+/* Entries of a TOC bucket start with the lead-out and the disc */
+int compare_toc_entry(const void *a, const void *b)
+{
+    const guint32 *entry_a = a;
+    const guint32 *entry_b = b;
+
+    if (entry_a[0] != entry_b[0])
+        return entry_a[0] < entry_b[0] ? -1 : 1;
+
+    return entry_a[1] < entry_b[1] ? -1 : entry_a[1] > entry_b[1];
+}
+
+
+/*
+ * Read the TOCs back and lay them out as the index wants them. Called once
+ * the disc IDs are sorted, TOCs refer to the first entry of their disc. A
+ * disc found on several releases is only kept once.
+ */
+GByteArray *dump_build_toc_table(DumpImport *import)
+{
+    GByteArray *entries[INDEX_TOC_BUCKETS];
+    IndexTocBucket buckets[INDEX_TOC_BUCKETS] = { { 0 } };
+    guint8 *seen = g_new0(guint8, import->discs->len);
+    GByteArray *table = g_byte_array_new();
+    guint32 offsets[INDEX_TOC_BUCKETS];
+    guint64 offset = sizeof(buckets);
+    DumpToc toc;
+
+    for (guint32 tracks = 0; tracks < INDEX_TOC_BUCKETS; tracks++)
+        entries[tracks] = g_byte_array_new();
+
+    rewind(import->tocs);
+
+    while (fread(&toc, sizeof(toc), 1, import->tocs) == 1
+           && toc.track_count < INDEX_TOC_BUCKETS
+           && fread(offsets, sizeof(guint32), toc.track_count, import->tocs) == toc.track_count) {
+        guint32 disc = index_find_disc((const IndexDisc *)import->discs->data, import->discs->len, toc.discid);
+
+        if (disc == import->discs->len || seen[disc])
+            continue;
+
+        seen[disc] = TRUE;
+
+        g_byte_array_append(entries[toc.track_count], (const guint8 *)&toc.leadout, sizeof(guint32));
+        g_byte_array_append(entries[toc.track_count], (const guint8 *)&disc, sizeof(guint32));
+        g_byte_array_append(entries[toc.track_count], (const guint8 *)offsets, toc.track_count * sizeof(guint32));
+    }
+
+    for (guint32 tracks = 0; tracks < INDEX_TOC_BUCKETS; tracks++) {
+        gsize entry_size = (2 + tracks) * sizeof(guint32);
+
+        buckets[tracks].offset = offset;
+        buckets[tracks].count = entries[tracks]->len / entry_size;
+        offset += entries[tracks]->len;
+
+        if (buckets[tracks].count > 1)
+            qsort(entries[tracks]->data, buckets[tracks].count, entry_size, compare_toc_entry);
+    }
+
+    g_byte_array_append(table, (const guint8 *)buckets, sizeof(buckets));
+
+    // From an array of entries to one array per field
+    for (guint32 tracks = 0; tracks < INDEX_TOC_BUCKETS; tracks++) {
+        guint32 *entry = (guint32 *)entries[tracks]->data;
+        guint32 count = buckets[tracks].count;
+
+        for (guint32 i = 0; i < count; i++)
+            g_byte_array_append(table, (const guint8 *)&entry[i * (2 + tracks)], sizeof(guint32));
+        for (guint32 i = 0; i < count; i++)
+            g_byte_array_append(table, (const guint8 *)&entry[i * (2 + tracks) + 1], sizeof(guint32));
+        for (guint32 i = 0; i < count; i++)
+            g_byte_array_append(table, (const guint8 *)&entry[i * (2 + tracks) + 2], tracks * sizeof(guint32));
+
+        g_byte_array_free(entries[tracks], TRUE);
+    }
+
+    g_free(seen);
+
+    return table;
+}
+
+
+gboolean copy_stream(FILE *from, FILE *to)
+{
+    gchar buffer[65536];
+    size_t length;
+
+    rewind(from);
+
+    while ((length = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        if (fwrite(buffer, 1, length, to) != length)
+            return FALSE;
+    }
+
+    return !ferror(from);
+}
+
+
+gboolean dump_write_index(DumpImport *import, const char *path)
+{
+    static const guint8 padding[8] = { 0 };
+    gchar *temp_path = g_strconcat(path, ".tmp", NULL);
+    IndexHeader header = { 0 };
+    GByteArray *tocs;
+    gboolean success;
+    FILE *out;
+
+    g_array_sort(import->discs, compare_index_disc);
+    tocs = dump_build_toc_table(import);
+
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.disc_count = import->discs->len;
+    header.releases_offset = sizeof(IndexHeader);
+    header.strings_offset = header.releases_offset + import->releases_size;
+    header.discs_offset = (header.strings_offset + import->strings_size + 7) & ~(guint64)7;
+    header.tocs_offset = header.discs_offset + (guint64)import->discs->len * sizeof(IndexDisc);
+    header.size = header.tocs_offset + tocs->len;
+
+    out = fopen(temp_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error: can't create %s: %s\n", temp_path, g_strerror(errno));
+        g_byte_array_free(tocs, TRUE);
+        g_free(temp_path);
+        return FALSE;
+    }
+
+    success = fwrite(&header, sizeof(header), 1, out) == 1
+        && copy_stream(import->releases, out)
+        && copy_stream(import->strings, out)
+        && fwrite(padding, 1, header.discs_offset - header.strings_offset - import->strings_size, out)
+               == header.discs_offset - header.strings_offset - import->strings_size
+        && fwrite(import->discs->data, sizeof(IndexDisc), import->discs->len, out) == import->discs->len
+        && fwrite(tocs->data, 1, tocs->len, out) == tocs->len;
+
+    success = fclose(out) == 0 && success;
+    g_byte_array_free(tocs, TRUE);
+
+    // Replace the old index in one go, lookups running against it keep their mapping
+    if (success && rename(temp_path, path) != 0)
+        success = FALSE;
+
+    if (!success) {
+        fprintf(stderr, "Error: can't write %s: %s\n", path, g_strerror(errno));
+        unlink(temp_path);
+    }
+
+    g_free(temp_path);
+
+    return success;
+}
+
+
+int import_dump(const char *dump_path, const char *index_path, int workers)
+{
+    DumpImport import = { 0 };
+    GThreadPool *pool;
+    GError *error = NULL;
+    FILE *input;
+    gchar *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    int status = 0;
+
+    if (strcmp(dump_path, "-") == 0) {
+        input = stdin;
+    } else if ((input = fopen(dump_path, "r")) == NULL) {
+        fprintf(stderr, "Error: can't open %s: %s\n", dump_path, g_strerror(errno));
+        return 1;
+    }
+
+    g_mutex_init(&import.lock);
+    g_cond_init(&import.cond);
+    import.releases = tmpfile();
+    import.strings = tmpfile();
+    import.tocs = tmpfile();
+    import.discs = g_array_new(FALSE, FALSE, sizeof(IndexDisc));
+
+    pool = g_thread_pool_new(dump_import_worker, &import, workers, FALSE, &error);
+
+    if (pool == NULL || import.releases == NULL || import.strings == NULL || import.tocs == NULL) {
+        fprintf(stderr, "Error: %s\n", error ? error->message : g_strerror(errno));
+        g_clear_error(&error);
+        status = 1;
+    }
+
+    while (status == 0 && (length = getline(&line, &line_size, input)) != -1) {
+        if (length <= 1)
+            continue;
+
+        // Don't read further ahead than the parsers can keep up with
+        g_mutex_lock(&import.lock);
+        while (import.queued >= (guint)workers * IMPORT_QUEUED_PER_WORKER)
+            g_cond_wait(&import.cond, &import.lock);
+        import.queued++;
+        g_mutex_unlock(&import.lock);
+
+        g_thread_pool_push(pool, g_strndup(line, length), NULL);
+    }
+
+    if (pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+
+    if (status == 0 && ferror(input)) {
+        fprintf(stderr, "Error: can't read %s: %s\n", dump_path, g_strerror(errno));
+        status = 1;
+    }
+
+    if (status == 0 && import.failed) {
+        fprintf(stderr, "Error: can't write the index, out of disk space or the string table is over 4 GiB\n");
+        status = 1;
+    }
+
+    if (status == 0 && !dump_write_index(&import, index_path))
+        status = 1;
+
+    if (status == 0)
+        printf("Imported %u release(s) with %u disc ID(s), %u line(s) skipped\n",
+               import.release_count, import.discs->len, import.skipped);
+
+    if (input != stdin)
+        fclose(input);
+
+    if (import.releases)
+        fclose(import.releases);
+    if (import.strings)
+        fclose(import.strings);
+    if (import.tocs)
+        fclose(import.tocs);
+
+    g_array_free(import.discs, TRUE);
+    g_cond_clear(&import.cond);
+    g_mutex_clear(&import.lock);
+    free(line);
+
+    return status;
+}
+
+
+/*
+ * Release fan-out
+ *
+ * When several releases of a disc have to be fetched on their own, the
+ * fetches are handed to a shared pool of threads, each with its own query
+ * object and connection. The pool size bounds the number of fetches in
+ * flight across all lookups; the scheduler still decides when each one may
+ * go out.
+ */
+
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    guint remaining;
+} FanoutGroup;
+
+typedef struct {
+    FanoutGroup *group;         /* NULL if the release doesn't need fetching */
+    QueryPriority priority;
+    const char *discid;
+    gchar *release_ID;
+    gboolean found;
+    ReleaseResult result;
+    GArray *siblings;           /* SiblingRelease, NULL unless prefetch_media is set */
+    Arena strings;              /* handed over to the DiscResult when done */
+} ReleaseFetch;
+
+static GThreadPool *fanout_pool = NULL;
+
+
+/*
+ * Sibling media
+ *
+ * A release fetched for one disc of a set already carries every medium of
+ * the set, with its disc IDs and tracks. Each of the other discs is turned
+ * into a result of its own and handed back in DiscResult.siblings, so that
+ * the rest of a box set can be answered from the disc cache or the daemon's
+ * LRU without going back to the server. Such a result only has the releases
+ * this lookup happened to see the disc in.
+ */
+
+typedef struct {
+    gchar *discid;
+    ReleaseResult result;
+} SiblingRelease;
+
+static gboolean prefetch_media = FALSE;
+
+
+void collect_sibling_media(Mb5Release release, const char *discid, Arena *arena, GArray *siblings)
+{
+    Mb5MediumList medium_list = mb5_release_get_mediumlist(release);
+    guint first = siblings->len;
+
+    if (!medium_list)
+        return;
+
+    for (int current_medium = 0; current_medium < mb5_medium_list_size(medium_list); current_medium++) {
+        Mb5Medium medium = mb5_medium_list_item(medium_list, current_medium);
+        Mb5DiscList disc_list = medium ? mb5_medium_get_disclist(medium) : NULL;
+
+        for (int current_disc = 0; disc_list && current_disc < mb5_disc_list_size(disc_list); current_disc++) {
+            Mb5Disc disc = mb5_disc_list_item(disc_list, current_disc);
+            SiblingRelease sibling;
+            gboolean seen = FALSE;
+
+            if (!disc)
+                continue;
+
+            sibling.discid = ARENA_GET(arena, mb5_disc_get_id, disc);
+            if (*sibling.discid == '\0' || strcmp(sibling.discid, discid) == 0)
+                continue;
+
+            // extract_release() takes every medium with the disc ID, so once is enough
+            for (guint i = first; i < siblings->len && !seen; i++)
+                seen = strcmp(g_array_index(siblings, SiblingRelease, i).discid, sibling.discid) == 0;
+
+            if (seen || !release_is_complete(release, sibling.discid))
+                continue;
+
+            extract_release(&sibling.result, arena, release, sibling.discid);
+            g_array_append_val(siblings, sibling);
+        }
+    }
+}
+
+
+/*
+ * Group the sibling releases of the fetches by disc ID, keeping the order of
+ * the release list. If a release couldn't be fetched, the other discs may be
+ * in it too, so none of them is kept.
+ */
+void disc_result_add_siblings(DiscResult *disc_result, ReleaseFetch *fetches, int count)
+{
+    GHashTable *by_discid = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (int i = 0; i < count; i++) {
+        GArray *siblings = fetches[i].siblings;
+
+        if (siblings == NULL)
+            continue;
+
+        if (disc_result->failed_releases > 0) {
+            for (guint j = 0; j < siblings->len; j++)
+                release_result_clear(&g_array_index(siblings, SiblingRelease, j).result);
+
+            g_array_free(siblings, TRUE);
+            continue;
+        }
+
+        for (guint j = 0; j < siblings->len; j++) {
+            SiblingRelease *sibling = &g_array_index(siblings, SiblingRelease, j);
+            DiscResult *result = g_hash_table_lookup(by_discid, sibling->discid);
+
+            if (result == NULL) {
+                result = disc_result_new(sibling->discid);
+                result->query_result = disc_result->query_result;
+                result->http_code = disc_result->http_code;
+                result->prefetched = TRUE;
+                result->releases = g_array_new(FALSE, TRUE, sizeof(ReleaseResult));
+
+                if (disc_result->siblings == NULL)
+                    disc_result->siblings = g_ptr_array_new_with_free_func((GDestroyNotify)disc_result_free);
+
+                g_ptr_array_add(disc_result->siblings, result);
+                g_hash_table_insert(by_discid, result->discid, result);
+            }
+
+            g_array_append_val(result->releases, sibling->result);
+        }
+
+        g_array_free(siblings, TRUE);
+    }
+
+    g_hash_table_destroy(by_discid);
+}
+
+
+static const char *release_includes = RELEASE_INCLUDES;
+
+
+/* Stand in for a release that couldn't be fetched, with why from the last attempt */
+void release_result_set_failed(ReleaseResult *result, Arena *arena, const char *release_ID, Mb5Query query)
+{
+    result->id = arena_strdup(arena, release_ID);
+    result->artists = g_ptr_array_new();
+    result->failed = TRUE;
+    result->query_result = mb5_query_get_lastresult(query);
+    result->http_code = mb5_query_get_lasthttpcode(query);
+    result->error_message = ARENA_GET(arena, mb5_query_get_lasterrormessage, query);
+}
+
+
+gboolean fetch_release(Mb5Query query, QueryPriority priority, const char *release_ID, const char *discid, ReleaseResult *result, Arena *arena, GArray *siblings)
+{
+    Mb5Metadata metadata2 = query_with_includes(query, priority, "release", release_ID, release_includes);
+
+    if (metadata2 == NULL) {
+        release_result_set_failed(result, arena, release_ID, query);
+        return FALSE;
+    }
+
+    extract_release(result, arena, mb5_metadata_get_release(metadata2), discid);
+
+    if (siblings && mb5_metadata_get_release(metadata2))
+        collect_sibling_media(mb5_metadata_get_release(metadata2), discid, arena, siblings);
+
+    /* We must delete anything returned from the query methods */
+    mb5_metadata_delete(metadata2);
+
+    return TRUE;
+}
+
+
+void release_fetch_worker(gpointer data, gpointer user_data)
+{
+    ReleaseFetch *fetch = data;
+    FanoutGroup *group = fetch->group;
+
+    fetch->found = fetch_release(thread_query(), fetch->priority, fetch->release_ID, fetch->discid, &fetch->result, &fetch->strings, fetch->siblings);
+
+    g_mutex_lock(&group->lock);
+    if (--group->remaining == 0)
+        g_cond_signal(&group->cond);
+    g_mutex_unlock(&group->lock);
+}
+
+
+/* Fetch every release that needs it, concurrently if there is more than one */
+void fetch_releases(Mb5Query query, ReleaseFetch *fetches, int count, FanoutGroup *group)
+{
+    guint pending = 0;
+
+    for (int i = 0; i < count; i++)
+        pending += fetches[i].group != NULL;
+
+    if (pending < 2 || fanout_pool == NULL) {
+        for (int i = 0; i < count; i++) {
+            if (fetches[i].group)
+                fetches[i].found = fetch_release(query, fetches[i].priority, fetches[i].release_ID, fetches[i].discid, &fetches[i].result, &fetches[i].strings, fetches[i].siblings);
+        }
+        return;
+    }
+
+    group->remaining = pending;
+
+    for (int i = 0; i < count; i++) {
+        if (fetches[i].group)
+            g_thread_pool_push(fanout_pool, &fetches[i], NULL);
+    }
+
+    g_mutex_lock(&group->lock);
+    while (group->remaining > 0)
+        g_cond_wait(&group->cond, &group->lock);
+    g_mutex_unlock(&group->lock);
+}
+
+
+/* toc may be NULL, it is only needed for fuzzy matching */
+DiscResult *cd_lookup(Mb5Query query, QueryPriority priority, const char *discid, const DiscToc *toc, LookupMode mode)
+{
+    DiscResult *disc_result;
+
+    if (offline_index) {
+        gint64 start = metrics_now();
+
+        disc_result = offline_index_lookup(offline_index, discid);
+        metrics_record(STAGE_INDEX_LOOKUP, start);
+
+        if (disc_result)
+            return disc_result;
+    }
+
+    disc_result = disc_result_new(discid);
+
+    if (query)
+    {
+        Mb5Metadata metadata1;
+
+        if (mode == LOOKUP_MODE_SINGLE)
+            metadata1 = query_with_includes(query, priority, "discid", discid, DISCID_INCLUDES);
+        else
+            metadata1 = scheduled_query(query, priority, "discid", discid, "", 0, NULL, NULL);
+
+        disc_result->query_result = mb5_query_get_lastresult(query);
+        disc_result->http_code = mb5_query_get_lasthttpcode(query);
+        disc_result->error_message = ARENA_GET(&disc_result->strings, mb5_query_get_lasterrormessage, query);
+
+        if (metadata1)
+        {
+            Mb5Disc disc = mb5_metadata_get_disc(metadata1);
+            if (disc)
+            {
+                Mb5ReleaseList release_list = mb5_disc_get_releaselist(disc);
+                if (release_list)
+                {
+                    int current_release = 0;
+                    int release_count = mb5_release_list_size(release_list);
+                    ReleaseFetch *fetches = g_new0(ReleaseFetch, release_count);
+                    FanoutGroup group;
+
+                    g_mutex_init(&group.lock);
+                    g_cond_init(&group.cond);
+
+                    disc_result->releases = g_array_new(FALSE, TRUE, sizeof(ReleaseResult));
+
+                    for (current_release = 0; current_release < release_count; current_release++)
+                    {
+                        Mb5Release Release = mb5_release_list_item(release_list, current_release);
+                        ReleaseFetch *fetch = &fetches[current_release];
+
+                        if (!Release)
+                            continue;
+
+                        if (prefetch_media)
+                            fetch->siblings = g_array_new(FALSE, FALSE, sizeof(SiblingRelease));
+
+                        if (mode == LOOKUP_MODE_SINGLE && release_is_complete(Release, discid))
+                        {
+                            extract_release(&fetch->result, &disc_result->strings, Release, discid);
+                            fetch->found = TRUE;
+
+                            if (fetch->siblings)
+                                collect_sibling_media(Release, discid, &disc_result->strings, fetch->siblings);
+                            continue;
+                        }
+
+                        /* The discid query didn't give us everything, the full release has to be fetched */
+
+                        fetch->group = &group;
+                        fetch->priority = priority;
+                        fetch->discid = discid;
+                        fetch->release_ID = ARENA_GET(&fetch->strings, mb5_release_get_id, Release);
+                    }
+
+                    // Everything we need from the disc response has been copied out by now
+                    mb5_metadata_delete(metadata1);
+                    metadata1 = NULL;
+
+                    fetch_releases(query, fetches, release_count, &group);
+
+                    // Keep the order of the release list, whatever order the fetches finished in
+                    for (current_release = 0; current_release < release_count; current_release++)
+                    {
+                        // A release that couldn't be fetched is kept, marked failed, so the error shows
+                        if (fetches[current_release].found || fetches[current_release].group)
+                            g_array_append_val(disc_result->releases, fetches[current_release].result);
+
+                        disc_result->failed_releases += fetches[current_release].result.failed;
+
+                        arena_steal(&disc_result->strings, &fetches[current_release].strings);
+                    }
+
+                    disc_result_add_siblings(disc_result, fetches, release_count);
+
+                    g_cond_clear(&group.cond);
+                    g_mutex_clear(&group.lock);
+                    g_free(fetches);
+                }
+            }
+
+            /* We must delete anything returned from the query methods */
+            if (metadata1)
+                mb5_metadata_delete(metadata1);
+        }
+    }
+
+    // Nothing under this disc ID, maybe under another pressing of it
+    if (disc_result->releases == NULL && offline_index && toc && fuzzy_tolerance > 0) {
+        gint64 start = metrics_now();
+
+        offline_index_fuzzy_lookup(offline_index, toc, fuzzy_tolerance, disc_result);
+        metrics_record(STAGE_INDEX_LOOKUP, start);
+    }
+
+    return disc_result;
+}
+
+
+/* Look the disc up in the cache first, and remember what we had to fetch */
+DiscResult *lookup_disc(Mb5Query query, QueryPriority priority, DiscCache *cache, const char *discid, const DiscToc *toc, LookupMode mode)
+{
+    DiscResult *result = NULL;
+    gint64 lookup_start = g_get_monotonic_time();
+
+    if (cache) {
+        gint64 start = metrics_now();
+
+        result = disc_cache_lookup(cache, discid);
+        metrics_record(STAGE_CACHE_LOOKUP, start);
+
+        if (result)
+            result->cached = TRUE;
+    }
+
+    if (result == NULL) {
+        result = cd_lookup(query, priority, discid, toc, mode);
+
+        // No point in caching what the offline index already has, or a guess
+        if (cache && !result->offline && disc_result_cacheable(result))
+            disc_cache_store(cache, result);
+
+        // Never replace what a lookup of the disc itself found
+        for (guint i = 0; cache && result->siblings && i < result->siblings->len; i++) {
+            DiscResult *sibling = g_ptr_array_index(result->siblings, i);
+
+            if (disc_result_cacheable(sibling) && !disc_cache_contains(cache, sibling->discid))
+                disc_cache_store(cache, sibling);
+        }
+    }
+
+    result->lookup_time = g_get_monotonic_time() - lookup_start;
+
+    return result;
+}
+
+
+static gchar *opt_lookup_mode = NULL;
+static gchar *opt_cache_file = NULL;
+static gboolean opt_no_cache = FALSE;
+static gint64 opt_cache_ttl = CACHE_DEFAULT_TTL;
+static gboolean opt_cache_invalidate = FALSE;
+static gboolean opt_cache_stats = FALSE;
+static gchar *opt_batch = NULL;
+static gint opt_workers = 4;
+static gboolean opt_unordered = FALSE;
+static gchar *opt_server = NULL;
+static gdouble opt_rate = 0.0;
+static gdouble opt_burst = 1.0;
+static gint opt_max_retries = 3;
+static gboolean opt_scheduler_stats = FALSE;
+static gint opt_fanout = 4;
+static gchar *opt_daemon = NULL;
+static gint opt_lru_size = 1024;
+static gboolean opt_alloc_stats = FALSE;
+static gchar *opt_index = NULL;
+static gchar *opt_import_dump = NULL;
+static gint opt_fuzzy_tolerance = FUZZY_DEFAULT_TOLERANCE;
+static gchar *opt_metrics = NULL;
+static gchar *opt_metrics_file = NULL;
+static gchar *opt_benchmark = NULL;
+static gint opt_bench_discs = 200;
+static gint opt_bench_latency = 0;
+static gdouble opt_bench_503_rate = 0.0;
+static gchar *opt_bench_fixtures = NULL;
+static gchar *opt_format = NULL;
+static gboolean opt_flush = FALSE;
+static gboolean opt_no_prefetch = FALSE;
+static gchar *opt_inc = NULL;
+static gint opt_max_memory = 0;
+static gchar *opt_devices = NULL;
+static gchar *opt_toc_dir = NULL;
+static gint opt_poll_interval = 2;
+
+static GOptionEntry option_entries[] =
+{
+    { "lookup-mode", 'm', 0, G_OPTION_ARG_STRING, &opt_lookup_mode, "How releases are looked up: single (default), per-release or compare", "MODE" },
+    { "cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_cache_file, "Disc cache file (default: ~/.cache/musicbrainz_example/discs.cache)", "FILE" },
+    { "no-cache", 0, 0, G_OPTION_ARG_NONE, &opt_no_cache, "Don't use the disc cache", NULL },
+    { "cache-ttl", 0, 0, G_OPTION_ARG_INT64, &opt_cache_ttl, "Seconds before a cached disc is looked up again, 0 for never (default: 30 days)", "SECONDS" },
+    { "cache-invalidate", 0, 0, G_OPTION_ARG_NONE, &opt_cache_invalidate, "Drop the cached entry for the disc and look it up again", NULL },
+    { "cache-stats", 0, 0, G_OPTION_ARG_NONE, &opt_cache_stats, "Print cache hit/miss counters to stderr", NULL },
+    { "batch", 'b', 0, G_OPTION_ARG_FILENAME, &opt_batch, "Look up the disc IDs or TOCs listed in FILE, one per line (- for stdin)", "FILE" },
+    { "workers", 'j', 0, G_OPTION_ARG_INT, &opt_workers, "Number of concurrent lookups in batch and daemon mode (default: 4)", "N" },
+    { "unordered", 0, 0, G_OPTION_ARG_NONE, &opt_unordered, "Write batch results as they complete instead of in input order", NULL },
+    { "server", 0, 0, G_OPTION_ARG_STRING, &opt_server, "Query HOST[:PORT] instead of musicbrainz.org", "HOST[:PORT]" },
+    { "rate", 0, 0, G_OPTION_ARG_DOUBLE, &opt_rate, "Maximum number of requests per second (default: 1, unlimited in benchmark mode)", "RATE" },
+    { "burst", 0, 0, G_OPTION_ARG_DOUBLE, &opt_burst, "Number of requests that may be sent back to back (default: 1)", "N" },
+    { "max-retries", 0, 0, G_OPTION_ARG_INT, &opt_max_retries, "Number of times a failed or throttled request is retried (default: 3)", "N" },
+    { "scheduler-stats", 0, 0, G_OPTION_ARG_NONE, &opt_scheduler_stats, "Print request scheduler statistics to stderr", NULL },
+    { "fanout", 0, 0, G_OPTION_ARG_INT, &opt_fanout, "Number of releases fetched concurrently, 1 to fetch them one by one (default: 4)", "N" },
+    { "daemon", 'd', 0, G_OPTION_ARG_FILENAME, &opt_daemon, "Serve lookups on the Unix domain socket PATH", "PATH" },
+    { "lru-size", 0, 0, G_OPTION_ARG_INT, &opt_lru_size, "Number of discs kept in memory in daemon mode (default: 1024)", "N" },
+    { "alloc-stats", 0, 0, G_OPTION_ARG_NONE, &opt_alloc_stats, "Print how many strings were extracted and how many blocks they took to stderr", NULL },
+    { "index", 0, 0, G_OPTION_ARG_FILENAME, &opt_index, "Look discs up in the offline index FILE before going to the network", "FILE" },
+    { "fuzzy-tolerance", 0, 0, G_OPTION_ARG_INT, &opt_fuzzy_tolerance, "Sectors a track may be off for a TOC to match an unknown disc in the index, 0 to only match exactly (default: 75)", "SECTORS" },
+    { "metrics", 0, 0, G_OPTION_ARG_STRING, &opt_metrics, "Time each stage of the lookups and write the histograms out at exit, as json or prometheus", "FORMAT" },
+    { "metrics-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_metrics_file, "Write the --metrics output to FILE instead of stderr", "FILE" },
+    { "benchmark", 0, 0, G_OPTION_ARG_STRING, &opt_benchmark, "Benchmark lookups against a built-in stub server: small, popular, boxset, recorded or all, comma separated", "SCENARIOS" },
+    { "bench-discs", 0, 0, G_OPTION_ARG_INT, &opt_bench_discs, "Number of discs looked up per benchmark scenario (default: 200)", "N" },
+    { "bench-latency", 0, 0, G_OPTION_ARG_INT, &opt_bench_latency, "Milliseconds the stub server waits before each response (default: 0)", "MS" },
+    { "bench-503-rate", 0, 0, G_OPTION_ARG_DOUBLE, &opt_bench_503_rate, "Fraction of the requests the stub server answers with a 503, from 0 to 1 (default: 0)", "FRACTION" },
+    { "bench-fixtures", 0, 0, G_OPTION_ARG_FILENAME, &opt_bench_fixtures, "Serve recorded responses from DIR/<entity>/<id>.xml (<id>.inc.xml for requests with includes), and look up the TOCs in DIR/tocs.txt as the recorded scenario", "DIR" },
+    { "no-prefetch", 0, 0, G_OPTION_ARG_NONE, &opt_no_prefetch, "Don't keep the other media of multi-disc releases in the cache", NULL },
+    { "inc", 0, 0, G_OPTION_ARG_STRING, &opt_inc, "Includes requested when a release is fetched on its own, must keep discids (default: \"" RELEASE_INCLUDES "\")", "INCLUDES" },
+    { "max-memory", 0, 0, G_OPTION_ARG_INT, &opt_max_memory, "Parse responses one at a time while the process's anonymous memory (its resident set less mapped files) is above MB", "MB" },
+    { "devices", 0, 0, G_OPTION_ARG_STRING, &opt_devices, "Watch the comma separated drives and look up each disc put in them", "DEVICES" },
+    { "toc-dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_toc_dir, "Watch the files in DIR as drives, each holding the TOC or disc ID of its disc, if any", "DIR" },
+    { "poll-interval", 0, 0, G_OPTION_ARG_INT, &opt_poll_interval, "Seconds between checks for a new disc in --devices or --toc-dir (default: 2)", "SECONDS" },
+    { "format", 'f', 0, G_OPTION_ARG_STRING, &opt_format, "Write the results as text (default), json (a single array) or ndjson (one object per line)", "FORMAT" },
+    { "flush", 0, 0, G_OPTION_ARG_NONE, &opt_flush, "Write each result out as soon as it is ready instead of buffering the output", NULL },
+    { "import-dump", 0, 0, G_OPTION_ARG_FILENAME, &opt_import_dump, "Build the --index file from a MusicBrainz JSON dump, one release per line (- for stdin)", "FILE" },
+    { NULL }
+};
+
+
+DiscCache *open_default_cache(void)
+{
+    DiscCache *cache;
+    GError *error = NULL;
+    gchar *path;
+
+    if (opt_no_cache)
+        return NULL;
+
+    if (opt_cache_file) {
+        path = g_strdup(opt_cache_file);
+    } else {
+        gchar *directory = g_build_filename(g_get_user_cache_dir(), "musicbrainz_example", NULL);
+
+        g_mkdir_with_parents(directory, 0755);
+        path = g_build_filename(directory, "discs.cache", NULL);
+        g_free(directory);
+    }
+
+    cache = disc_cache_open(path, opt_cache_ttl, &error);
+    if (cache == NULL) {
+        // Not fatal, we just go to the network every time
+        fprintf(stderr, "Warning: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_free(path);
+
+    return cache;
+}
+
+
+/*
+ * Run both lookup paths and check that the single query gives the same
+ * result as fetching every release on its own, rendered as text into single
+ * and per_release. This always goes to the network, the cache is left alone.
+ */
+gboolean compare_lookup_modes(Mb5Query query, QueryPriority priority, const char *discid, GString *single, GString *per_release)
+{
+    DiscResult *result = cd_lookup(query, priority, discid, NULL, LOOKUP_MODE_SINGLE);
+    DiscResult *reference_result = cd_lookup(query, priority, discid, NULL, LOOKUP_MODE_PER_RELEASE);
+
+    disc_result_render(result, OUTPUT_FORMAT_TEXT, single);
+    disc_result_render(reference_result, OUTPUT_FORMAT_TEXT, per_release);
+
+    disc_result_free(reference_result);
+    disc_result_free(result);
+
+    return g_string_equal(single, per_release);
+}
+
+
+int lookup_single_disc(LookupMode mode, DiscCache *cache, OutputWriter *output)
+{
+    int status = 0;
+    Mb5Query query;
+
+    DiscId *disc = discid_new();
+    gint64 start = metrics_now();
+    
+    if ( discid_read_sparse(disc, "/dev/cdrom", 0) == 0 ) {
+        fprintf(stderr, "Error: %s\n", discid_get_error_msg(disc));
+
+        discid_free(disc);
+        return 1;
+    }
+
+    metrics_record(STAGE_DISC_READ, start);
+
+    char *discid = discid_get_id(disc);
+    DiscToc toc;
+
+    disc_toc_from_discid(&toc, disc);
+
+    if (cache && opt_cache_invalidate)
+        disc_cache_invalidate(cache, discid);
+
+    query = new_query();
+
+    GString *out = g_string_new(NULL);
+
+    if (mode == LOOKUP_MODE_COMPARE) {
+        GString *reference = g_string_new(NULL);
+        gboolean identical = compare_lookup_modes(query, QUERY_PRIORITY_INTERACTIVE, discid, out, reference);
+
+        fputs(out->str, stdout);
+
+        if (identical) {
+            printf("Lookup modes: identical\n");
+        } else {
+            printf("Lookup modes: different\n");
+            fprintf(stderr, "Per-release lookup gave:\n%s", reference->str);
+            status = 1;
+        }
+
+        g_string_free(reference, TRUE);
+    } else {
+        DiscResult *result = lookup_disc(query, QUERY_PRIORITY_INTERACTIVE, cache, discid, &toc, mode);
+
+        start = metrics_now();
+        output_writer_write(output, result);
+        metrics_record(STAGE_OUTPUT, start);
+
+        disc_result_free(result);
+    }
+
+    g_string_free(out, TRUE);
+
+    if (query)
+        mb5_query_delete(query);
+
+    discid_free(disc);
+
+    return status;
+}
+
+
+/*
+ * Batch mode
+ *
+ * Reads one disc per line, either a disc ID or a TOC string as given by
+ * discid_get_toc_string() ("first last leadout offset1 ... offsetN"), and
+ * looks them up on a pool of worker threads. Each worker owns its own
+ * Mb5Query. The main thread reads the input, and writes the results out,
+ * either in input order or as they complete.
+ */
+
+#define BATCH_ERROR g_quark_from_static_string("musicbrainz-example-batch-error")
+
+typedef struct {
+    guint index;
+    guint line_number;
+    gchar *line;
+    gchar *discid;          /* NULL if the line couldn't be used */
+    DiscToc toc;
+    gchar *error;
+    DiscResult *result;
+} BatchJob;
+
+typedef struct {
+    LookupMode mode;
+    DiscCache *cache;
+    GAsyncQueue *done;      /* finished BatchJob's */
+} BatchContext;
+
+
+void batch_job_free(BatchJob *job)
+{
+    disc_result_free(job->result);
+    g_free(job->error);
+    g_free(job->discid);
+    g_free(job->line);
+    g_free(job);
+}
+
+
+/*
+ * Turn an input line into a disc ID, computing it from the TOC if needed.
+ * The TOC is filled in if the line has one, its track count is 0 otherwise.
+ */
+gchar *discid_from_line(const gchar *line, DiscToc *toc, GError **error)
+{
+    gchar **fields = g_strsplit_set(line, " \t", -1);
+    int values[3 + 99];
+    int count = 0;
+    gchar *discid = NULL;
+
+    toc->track_count = 0;
+
+    for (gchar **field = fields; *field; field++) {
+        gchar *end;
+
+        if (**field == '\0')
+            continue;
+
+        if (count == G_N_ELEMENTS(values)) {
+            g_set_error(error, BATCH_ERROR, 0, "too many TOC entries");
+            goto out;
+        }
+
+        values[count] = g_ascii_strtoll(*field, &end, 10);
+
+        if (*end != '\0') {
+            // Not a number, so it should be a disc ID on its own
+            if (count == 0 && field[1] == NULL && strlen(*field) == 28)
+                discid = g_strdup(*field);
+            else
+                g_set_error(error, BATCH_ERROR, 0, "'%s' is neither a disc ID nor a TOC", line);
+            goto out;
+        }
+
+        count++;
+    }
+
+    if (count < 3 || values[0] < 1 || values[1] < values[0] || values[1] > 99 || count != 3 + values[1] - values[0] + 1) {
+        g_set_error(error, BATCH_ERROR, 0, "'%s' is not a valid TOC", line);
+        goto out;
+    }
+
+    // discid_put() wants the lead-out first, then the offsets indexed by track number
+    int offsets[100] = { 0 };
+
+    offsets[0] = values[2];
+    for (int track = values[0]; track <= values[1]; track++)
+        offsets[track] = values[3 + track - values[0]];
+
+    DiscId *disc = discid_new();
+
+    if (discid_put(disc, values[0], values[1], offsets)) {
+        discid = g_strdup(discid_get_id(disc));
+        disc_toc_from_discid(toc, disc);
+    } else
+        g_set_error(error, BATCH_ERROR, 0, "%s", discid_get_error_msg(disc));
+
+    discid_free(disc);
+
+out:
+    g_strfreev(fields);
+
+    return discid;
+}
+
+
+void batch_worker(gpointer data, gpointer user_data)
+{
+    BatchJob *job = data;
+    BatchContext *context = user_data;
+    GError *error = NULL;
+    Mb5Query query = thread_query();
+
+    job->discid = discid_from_line(job->line, &job->toc, &error);
+
+    if (job->discid) {
+        job->result = lookup_disc(query, QUERY_PRIORITY_BULK, context->cache, job->discid, &job->toc, context->mode);
+    } else {
+        job->error = g_strdup(error->message);
+        g_error_free(error);
+    }
+
+    g_async_queue_push(context->done, job);
+}
+
+
+void batch_write(BatchJob *job, OutputWriter *output)
+{
+    if (job->error) {
+        fprintf(stderr, "Error: line %u: %s\n", job->line_number, job->error);
+        return;
+    }
+
+    gint64 start = metrics_now();
+
+    output_writer_write(output, job->result);
+    metrics_record(STAGE_OUTPUT, start);
+}
+
+
+int lookup_batch(const gchar *path, LookupMode mode, DiscCache *cache, gint workers, gboolean ordered, OutputWriter *output)
+{
+    BatchContext context = { mode, cache, g_async_queue_new() };
+    GHashTable *pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GThreadPool *pool;
+    FILE *input;
+    gchar *line = NULL;
+    size_t line_size = 0;
+    gboolean reading = TRUE;
+    guint line_number = 0;
+    guint submitted = 0;
+    guint written = 0;
+    guint failed = 0;
+    guint max_outstanding = workers * 4;
+    gint64 start = g_get_monotonic_time();
+
+    if (mode == LOOKUP_MODE_COMPARE) {
+        fprintf(stderr, "Error: compare mode is not available in batch mode\n");
+        return 1;
+    }
+
+    input = g_strcmp0(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", path, g_strerror(errno));
+        return 1;
+    }
+
+    pool = g_thread_pool_new(batch_worker, &context, workers, TRUE, NULL);
+
+    /*
+     * Keep at most max_outstanding discs between reading and writing, so a
+     * slow lookup holding back ordered output doesn't make us buffer the
+     * whole input.
+     */
+    while (reading || written < submitted) {
+        if (reading && submitted - written < max_outstanding) {
+            ssize_t length = getline(&line, &line_size, input);
+
+            if (length < 0) {
+                reading = FALSE;
+                continue;
+            }
+
+            line_number++;
+            g_strstrip(line);
+            if (*line == '\0' || *line == '#')
+                continue;
+
+            BatchJob *job = g_new0(BatchJob, 1);
+
+            job->index = submitted++;
+            job->line_number = line_number;
+            job->line = g_strdup(line);
+
+            g_thread_pool_push(pool, job, NULL);
+            continue;
+        }
+
+        BatchJob *job = g_async_queue_pop(context.done);
+
+        if (!ordered) {
+            batch_write(job, output);
+            failed += job->error != NULL || (job->result && disc_result_failed(job->result));
+            written++;
+            batch_job_free(job);
+            continue;
+        }
+
+        g_hash_table_insert(pending, GUINT_TO_POINTER(job->index), job);
+
+        while ((job = g_hash_table_lookup(pending, GUINT_TO_POINTER(written))) != NULL) {
+            g_hash_table_remove(pending, GUINT_TO_POINTER(written));
+            batch_write(job, output);
+            failed += job->error != NULL || (job->result && disc_result_failed(job->result));
+            written++;
+            batch_job_free(job);
+        }
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    output_writer_flush(output);
+
+    gdouble elapsed = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+    fprintf(stderr, "Batch: %u disc(s), %u failed, in %.2f s (%.1f discs/s)\n",
+            written, failed, elapsed, elapsed > 0 ? written / elapsed : 0.0);
+
+    if (input != stdin)
+        fclose(input);
+
+    free(line);
+    g_hash_table_destroy(pending);
+    g_async_queue_unref(context.done);
+
+    return failed ? 1 : 0;
+}
+
+
+/*
+ * Daemon mode
+ *
+ * Listens on a Unix domain socket. Clients send one disc ID or TOC per line,
+ * and get the same output as batch mode back, followed by an empty line.
+ * The line "STATS" returns latency statistics instead, and "METRICS" the
+ * stage metrics in the Prometheus text format.
+ *
+ * Lookups run on a fixed set of worker threads, so their query objects (and
+ * connections) stay warm. Answers are kept in an in-memory LRU, and
+ * concurrent requests for a disc that is already being looked up wait for
+ * that lookup instead of starting their own.
+ */
+
+#define DAEMON_LATENCY_SAMPLES 65536
+
+typedef struct {
+    gchar *discid;
+    gchar *response;
+    gboolean prefetched;    /* from another disc's release, see collect_sibling_media() */
+    GList *link;            /* in Daemon.lru_order, most recently used first */
+} LruEntry;
+
+typedef struct {
+    gchar *discid;
+    DiscToc toc;            /* of whichever request started the lookup */
+    gchar *response;        /* NULL until the lookup is done */
+    gint refs;
+} InflightLookup;
+
+typedef struct {
+    gint64 *samples;        /* ring buffer, in microseconds */
+    guint count;
+    guint64 total;
+} LatencySamples;
+
+typedef struct {
+    LookupMode mode;
+    DiscCache *cache;
+    GThreadPool *workers;
+
+    GMutex lock;
+    GCond lookup_done;
+    GHashTable *lru;        /* disc ID -> LruEntry */
+    GQueue lru_order;
+    guint lru_size;
+    GHashTable *inflight;   /* disc ID -> InflightLookup */
+
+    LatencySamples hits;
+    LatencySamples misses;
+    guint64 coalesced;
+    guint64 prefetched;
+    guint64 prefetch_hits;
+} Daemon;
+
+static volatile sig_atomic_t daemon_stopping = 0;
+
+
+void daemon_stop(int signal_number)
+{
+    daemon_stopping = 1;
+}
+
+
+void lru_entry_free(LruEntry *entry)
+{
+    g_free(entry->discid);
+    g_free(entry->response);
+    g_free(entry);
+}
+
+
+void inflight_unref(InflightLookup *inflight)
+{
+    if (--inflight->refs > 0)
+        return;
+
+    g_free(inflight->discid);
+    g_free(inflight->response);
+    g_free(inflight);
+}
+
+
+/* Called with the daemon lock held */
+void lru_insert(Daemon *daemon, const gchar *discid, const gchar *response, gboolean prefetched)
+{
+    LruEntry *entry;
+
+    if (daemon->lru_size == 0)
+        return;
+
+    entry = g_new0(LruEntry, 1);
+    entry->discid = g_strdup(discid);
+    entry->response = g_strdup(response);
+    entry->prefetched = prefetched;
+
+    g_queue_push_head(&daemon->lru_order, entry);
+    entry->link = g_queue_peek_head_link(&daemon->lru_order);
+    g_hash_table_replace(daemon->lru, entry->discid, entry);
+
+    while (g_queue_get_length(&daemon->lru_order) > daemon->lru_size) {
+        LruEntry *oldest = g_queue_pop_tail(&daemon->lru_order);
+
+        g_hash_table_remove(daemon->lru, oldest->discid);
+        lru_entry_free(oldest);
+    }
+}
+
+
+/* Called with the daemon lock held */
+void latency_add(LatencySamples *latency, gint64 value)
+{
+    latency->samples[latency->count % DAEMON_LATENCY_SAMPLES] = value;
+    latency->count++;
+    latency->total += value;
+}
+
+
+int compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Called with the daemon lock held */
+void latency_append_stats(GString *out, const char *name, const LatencySamples *latency)
+{
+    guint n = MIN(latency->count, DAEMON_LATENCY_SAMPLES);
+    gint64 *sorted;
+
+    if (n == 0) {
+        g_string_append_printf(out, "%s: 0\n", name);
+        return;
+    }
+
+    sorted = g_memdup2(latency->samples, n * sizeof(gint64));
+    qsort(sorted, n, sizeof(gint64), compare_gint64);
+
+    g_string_append_printf(out, "%s: %u, mean %.3f ms, p50 %.3f ms, p99 %.3f ms\n", name, latency->count,
+                           latency->total / 1000.0 / latency->count,
+                           sorted[(n - 1) * 50 / 100] / 1000.0, sorted[(n - 1) * 99 / 100] / 1000.0);
+
+    g_free(sorted);
+}
+
+
+void daemon_append_stats(Daemon *daemon, GString *out)
+{
+    g_mutex_lock(&daemon->lock);
+
+    latency_append_stats(out, "Hits", &daemon->hits);
+    latency_append_stats(out, "Misses", &daemon->misses);
+    g_string_append_printf(out, "Coalesced: %" G_GUINT64_FORMAT "\n", daemon->coalesced);
+    g_string_append_printf(out, "Prefetched media: %" G_GUINT64_FORMAT " stored, %" G_GUINT64_FORMAT " hit(s)\n", daemon->prefetched, daemon->prefetch_hits);
+    g_string_append_printf(out, "LRU entries: %u\n", g_queue_get_length(&daemon->lru_order));
+
+    g_mutex_unlock(&daemon->lock);
+}
+
+
+void daemon_worker(gpointer data, gpointer user_data)
+{
+    InflightLookup *inflight = data;
+    Daemon *daemon = user_data;
+    DiscResult *result = lookup_disc(thread_query(), QUERY_PRIORITY_INTERACTIVE, daemon->cache, inflight->discid, &inflight->toc, daemon->mode);
+    GString *out = g_string_new(NULL);
+    GPtrArray *sibling_responses = g_ptr_array_new_with_free_func(g_free);
+    gint64 start = metrics_now();
+
+    disc_result_render(result, OUTPUT_FORMAT_TEXT, out);
+
+    for (guint i = 0; result->siblings && i < result->siblings->len; i++) {
+        DiscResult *sibling = g_ptr_array_index(result->siblings, i);
+        GString *response = g_string_new(NULL);
+
+        disc_result_render(sibling, OUTPUT_FORMAT_TEXT, response);
+        g_ptr_array_add(sibling_responses, g_string_free(response, FALSE));
+    }
+
+    metrics_record(STAGE_OUTPUT, start);
+
+    g_mutex_lock(&daemon->lock);
+
+    // Other media of the releases, unless the disc is known or being looked up already
+    for (guint i = 0; i < sibling_responses->len; i++) {
+        DiscResult *sibling = g_ptr_array_index(result->siblings, i);
+
+        if (!disc_result_cacheable(sibling) || g_hash_table_contains(daemon->lru, sibling->discid)
+            || g_hash_table_contains(daemon->inflight, sibling->discid))
+            continue;
+
+        lru_insert(daemon, sibling->discid, g_ptr_array_index(sibling_responses, i), TRUE);
+        daemon->prefetched++;
+    }
+
+    // Failed lookups are not remembered, the next request tries again
+    if (disc_result_cacheable(result))
+        lru_insert(daemon, inflight->discid, out->str, result->prefetched);
+
+    inflight->response = g_string_free(out, FALSE);
+    g_hash_table_remove(daemon->inflight, inflight->discid);
+    g_cond_broadcast(&daemon->lookup_done);
+    inflight_unref(inflight);
+
+    g_mutex_unlock(&daemon->lock);
+
+    g_ptr_array_free(sibling_responses, TRUE);
+    disc_result_free(result);
+}
+
+
+/* Returns a newly allocated response for the disc */
+gchar *daemon_lookup(Daemon *daemon, const gchar *discid, const DiscToc *toc)
+{
+    gint64 start = g_get_monotonic_time();
+    InflightLookup *inflight;
+    LruEntry *entry;
+    gchar *response;
+
+    g_mutex_lock(&daemon->lock);
+
+    entry = g_hash_table_lookup(daemon->lru, discid);
+    if (entry) {
+        g_queue_unlink(&daemon->lru_order, entry->link);
+        g_queue_push_head_link(&daemon->lru_order, entry->link);
+
+        response = g_strdup(entry->response);
+        latency_add(&daemon->hits, g_get_monotonic_time() - start);
+        daemon->prefetch_hits += entry->prefetched;
+
+        g_mutex_unlock(&daemon->lock);
+        return response;
+    }
+
+    inflight = g_hash_table_lookup(daemon->inflight, discid);
+    if (inflight) {
+        daemon->coalesced++;
+        inflight->refs++;
+    } else {
+        inflight = g_new0(InflightLookup, 1);
+        inflight->discid = g_strdup(discid);
+        inflight->toc = *toc;
+        inflight->refs = 2;     /* the worker and us */
+
+        g_hash_table_insert(daemon->inflight, inflight->discid, inflight);
+        g_thread_pool_push(daemon->workers, inflight, NULL);
+    }
+
+    while (inflight->response == NULL)
+        g_cond_wait(&daemon->lookup_done, &daemon->lock);
+
+    response = g_strdup(inflight->response);
+    inflight_unref(inflight);
+    latency_add(&daemon->misses, g_get_monotonic_time() - start);
+
+    g_mutex_unlock(&daemon->lock);
+
+    return response;
+}
+
+
+gboolean write_all(int fd, const gchar *data, gsize length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return FALSE;
+
+        data += written;
+        length -= written;
+    }
+
+    return TRUE;
+}
+
+
+typedef struct {
+    Daemon *daemon;
+    int fd;
+} DaemonConnection;
+
+
+gpointer daemon_connection(gpointer data)
+{
+    DaemonConnection *connection = data;
+    FILE *input = fdopen(connection->fd, "r");
+    GString *out = g_string_new(NULL);
+    gchar *line = NULL;
+    size_t line_size = 0;
+
+    while (input && getline(&line, &line_size, input) >= 0) {
+        GError *error = NULL;
+        gchar *discid;
+        DiscToc toc;
+
+        g_strstrip(line);
+        if (*line == '\0')
+            continue;
+
+        g_string_truncate(out, 0);
+
+        if (g_strcmp0(line, "STATS") == 0) {
+            daemon_append_stats(connection->daemon, out);
+        } else if (g_strcmp0(line, "METRICS") == 0) {
+            metrics_append(out, "prometheus");
+        } else if ((discid = discid_from_line(line, &toc, &error)) != NULL) {
+            gchar *response = daemon_lookup(connection->daemon, discid, &toc);
+
+            g_string_append(out, response);
+            g_free(response);
+            g_free(discid);
+        } else {
+            g_string_append_printf(out, "Error: %s\n", error->message);
+            g_error_free(error);
+        }
+
+        g_string_append_c(out, '\n');
+
+        if (!write_all(connection->fd, out->str, out->len))
+            break;
+    }
+
+    if (input)
+        fclose(input);
+    else
+        close(connection->fd);
+
+    free(line);
+    g_string_free(out, TRUE);
+    g_free(connection);
+
+    return NULL;
+}
+
+
+int run_daemon(const gchar *socket_path, LookupMode mode, DiscCache *cache, gint workers, guint lru_size)
+{
+    Daemon daemon = { 0 };
+    struct sockaddr_un address = { 0 };
+    struct sigaction action = { 0 };
+    struct stat status;
+    GString *stats;
+    int listener;
+
+    if (mode == LOOKUP_MODE_COMPARE) {
+        fprintf(stderr, "Error: compare mode is not available in daemon mode\n");
+        return 1;
+    }
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+
+    // A socket left behind by an earlier run is replaced, anything else is not ours to remove
+    if (lstat(socket_path, &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            fprintf(stderr, "Error: '%s' exists and is not a socket\n", socket_path);
+            return 1;
+        }
+
+        unlink(socket_path);
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        fprintf(stderr, "Error: cannot listen on '%s': %s\n", socket_path, g_strerror(errno));
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+
+    // No SA_RESTART, so accept() returns when we are asked to stop
+    action.sa_handler = daemon_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon.mode = mode;
+    daemon.cache = cache;
+    daemon.lru = g_hash_table_new(g_str_hash, g_str_equal);
+    daemon.lru_size = lru_size;
+    daemon.inflight = g_hash_table_new(g_str_hash, g_str_equal);
+    daemon.hits.samples = g_new0(gint64, DAEMON_LATENCY_SAMPLES);
+    daemon.misses.samples = g_new0(gint64, DAEMON_LATENCY_SAMPLES);
+    g_queue_init(&daemon.lru_order);
+    g_mutex_init(&daemon.lock);
+    g_cond_init(&daemon.lookup_done);
+
+    // Exclusive threads, so each keeps its query object for the whole run
+    daemon.workers = g_thread_pool_new(daemon_worker, &daemon, workers, TRUE, NULL);
+
+    fprintf(stderr, "Listening on %s\n", socket_path);
+
+    while (!daemon_stopping) {
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno != EINTR)
+                fprintf(stderr, "Warning: accept: %s\n", g_strerror(errno));
+            continue;
+        }
+
+        DaemonConnection *connection = g_new0(DaemonConnection, 1);
+
+        connection->daemon = &daemon;
+        connection->fd = fd;
+
+        g_thread_unref(g_thread_new("connection", daemon_connection, connection));
+    }
+
+    close(listener);
+    unlink(socket_path);
+
+    stats = g_string_new(NULL);
+    daemon_append_stats(&daemon, stats);
+    fputs(stats->str, stderr);
+    g_string_free(stats, TRUE);
+
+    /*
+     * Connection threads may still be using the daemon, so it is left in
+     * place; we are about to exit anyway.
+     */
+
+    return 0;
+}
+
+
+/*
+ * Multi-drive mode
+ *
+ * Watches several drives at once. Each drive has a reader thread of its own,
+ * which polls it and reads the TOC whenever a different disc shows up. The
+ * lookups go to a pool of workers, so a slow lookup never holds up reading
+ * another drive, and results are written out as they complete, tagged with
+ * their drive.
+ *
+ * For testing, a directory of TOC files can stand in for the drives. Each
+ * file is a drive, holding a TOC or a disc ID as in batch mode, or nothing
+ * if the drive is empty.
+ */
+
+#define DRIVE_POLL_STEP 100     /* milliseconds between checks for a stop */
+
+typedef struct DriveWatch DriveWatch;
+
+typedef struct {
+    DriveWatch *watch;
+    gchar *path;
+    gboolean toc_file;      /* a file with a TOC in it, not a real drive */
+    GThread *reader;
+    gchar *discid;          /* of the disc in the drive, NULL if it is empty */
+    gboolean warned;        /* about the current contents of the TOC file */
+
+    /* Protected by DriveWatch.lock */
+    guint discs;
+    guint failed;
+    gint64 read_time;       /* in microseconds, summed over the discs */
+    gint64 lookup_time;
+} Drive;
+
+struct DriveWatch {
+    LookupMode mode;
+    DiscCache *cache;
+    OutputWriter *output;
+    gint poll_interval;     /* in milliseconds */
+    GThreadPool *workers;
+    GMutex lock;            /* for the output and the drive counters */
+    GPtrArray *drives;      /* Drive */
+};
+
+typedef struct {
+    Drive *drive;
+    gchar *discid;
+    DiscToc toc;
+    gint64 read_time;
+} DriveLookup;
+
+static volatile sig_atomic_t drives_stopping = 0;
+
+
+void drives_stop(int signal_number)
+{
+    drives_stopping = 1;
+}
+
+
+int compare_paths(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+
+void drive_free(Drive *drive)
+{
+    g_free(drive->discid);
+    g_free(drive->path);
+    g_free(drive);
+}
+
+
+/* Returns the disc ID of the disc in the drive, or NULL if there is none */
+gchar *drive_read(Drive *drive, DiscToc *toc)
+{
+    gchar *discid = NULL;
+
+    if (drive->toc_file) {
+        gchar *contents = NULL;
+        GError *error = NULL;
+
+        // A missing or empty file is an empty drive
+        if (g_file_get_contents(drive->path, &contents, NULL, NULL) && *g_strstrip(contents) != '\0') {
+            discid = discid_from_line(contents, toc, &error);
+
+            if (discid == NULL && !drive->warned)
+                fprintf(stderr, "Warning: %s: %s\n", drive->path, error->message);
+
+            drive->warned = discid == NULL;
+            g_clear_error(&error);
+        }
+
+        g_free(contents);
+    } else {
+        DiscId *disc = discid_new();
+
+        if (discid_read_sparse(disc, drive->path, 0)) {
+            discid = g_strdup(discid_get_id(disc));
+            disc_toc_from_discid(toc, disc);
+        }
+
+        discid_free(disc);
+    }
+
+    return discid;
+}
+
+
+gpointer drive_reader(gpointer data)
+{
+    Drive *drive = data;
+    DriveWatch *watch = drive->watch;
+
+    while (!drives_stopping) {
+        DiscToc toc;
+        gint64 start = g_get_monotonic_time();
+        gint64 metrics_start = metrics_now();
+        gchar *discid = drive_read(drive, &toc);
+
+        if (discid && g_strcmp0(discid, drive->discid) != 0) {
+            DriveLookup *lookup = g_new0(DriveLookup, 1);
+
+            metrics_record(STAGE_DISC_READ, metrics_start);
+
+            lookup->drive = drive;
+            lookup->discid = g_strdup(discid);
+            lookup->toc = toc;
+            lookup->read_time = g_get_monotonic_time() - start;
+
+            g_thread_pool_push(watch->workers, lookup, NULL);
+        }
+
+        g_free(drive->discid);
+        drive->discid = discid;
+
+        for (gint waited = 0; waited < watch->poll_interval && !drives_stopping; waited += DRIVE_POLL_STEP)
+            g_usleep(DRIVE_POLL_STEP * 1000);
+    }
+
+    return NULL;
+}
+
+
+void drive_lookup_worker(gpointer data, gpointer user_data)
+{
+    DriveLookup *lookup = data;
+    DriveWatch *watch = user_data;
+    Drive *drive = lookup->drive;
+    DiscResult *result = lookup_disc(thread_query(), QUERY_PRIORITY_INTERACTIVE, watch->cache, lookup->discid, &lookup->toc, watch->mode);
+    gint64 start;
+
+    result->device = arena_strdup(&result->strings, drive->path);
+
+    g_mutex_lock(&watch->lock);
+
+    start = metrics_now();
+    output_writer_write(watch->output, result);
+    metrics_record(STAGE_OUTPUT, start);
+
+    drive->discs++;
+    drive->failed += disc_result_failed(result);
+    drive->read_time += lookup->read_time;
+    drive->lookup_time += result->lookup_time;
+
+    g_mutex_unlock(&watch->lock);
+
+    disc_result_free(result);
+    g_free(lookup->discid);
+    g_free(lookup);
+}
+
+
+void drive_watch_print_stats(DriveWatch *watch, gdouble elapsed, FILE *stream)
+{
+    g_mutex_lock(&watch->lock);
+
+    for (guint i = 0; i < watch->drives->len; i++) {
+        Drive *drive = g_ptr_array_index(watch->drives, i);
+        guint discs = MAX(drive->discs, 1);
+
+        fprintf(stream, "Drive %s: %u disc(s), %u failed, %.1f discs/h, read %.1f ms, lookup %.1f ms on average\n",
+                drive->path, drive->discs, drive->failed, elapsed > 0 ? drive->discs * 3600 / elapsed : 0.0,
+                drive->read_time / 1000.0 / discs, drive->lookup_time / 1000.0 / discs);
+    }
+
+    g_mutex_unlock(&watch->lock);
+}
+
+
+/* The drives are the comma separated devices, or the files in toc_dir */
+int run_drives(const gchar *devices, const gchar *toc_dir, LookupMode mode, DiscCache *cache, gint workers, gint poll_interval, OutputWriter *output)
+{
+    DriveWatch watch = { 0 };
+    struct sigaction action = { 0 };
+    gint64 start = g_get_monotonic_time();
+
+    if (mode == LOOKUP_MODE_COMPARE) {
+        fprintf(stderr, "Error: compare mode is not available in multi-drive mode\n");
+        return 1;
+    }
+
+    watch.drives = g_ptr_array_new_with_free_func((GDestroyNotify)drive_free);
+
+    if (toc_dir) {
+        GError *error = NULL;
+        GDir *dir = g_dir_open(toc_dir, 0, &error);
+        GPtrArray *names = g_ptr_array_new();
+        const gchar *name;
+
+        if (dir == NULL) {
+            fprintf(stderr, "Error: %s\n", error->message);
+            g_error_free(error);
+            g_ptr_array_free(names, TRUE);
+            g_ptr_array_free(watch.drives, TRUE);
+            return 1;
+        }
+
+        while ((name = g_dir_read_name(dir)) != NULL)
+            g_ptr_array_add(names, g_build_filename(toc_dir, name, NULL));
+
+        g_ptr_array_sort(names, compare_paths);
+        g_dir_close(dir);
+
+        for (guint i = 0; i < names->len; i++) {
+            gchar *path = g_ptr_array_index(names, i);
+
+            if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+                g_free(path);
+                continue;
+            }
+
+            Drive *drive = g_new0(Drive, 1);
+
+            drive->path = path;
+            drive->toc_file = TRUE;
+            g_ptr_array_add(watch.drives, drive);
+        }
+
+        g_ptr_array_free(names, TRUE);
+    } else {
+        gchar **paths = g_strsplit(devices, ",", -1);
+
+        for (gchar **path = paths; *path; path++) {
+            if (**path == '\0')
+                continue;
+
+            Drive *drive = g_new0(Drive, 1);
+
+            drive->path = g_strdup(*path);
+            g_ptr_array_add(watch.drives, drive);
+        }
+
+        g_strfreev(paths);
+    }
+
+    if (watch.drives->len == 0) {
+        fprintf(stderr, "Error: no drives to watch\n");
+        g_ptr_array_free(watch.drives, TRUE);
+        return 1;
+    }
+
+    action.sa_handler = drives_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    watch.mode = mode;
+    watch.cache = cache;
+    watch.output = output;
+    watch.poll_interval = poll_interval * 1000;
+    g_mutex_init(&watch.lock);
+
+    // Someone is waiting at the drive, so every result goes out at once
+    output->flush_records = TRUE;
+
+    // Exclusive threads, so each keeps its query object for the whole run
+    watch.workers = g_thread_pool_new(drive_lookup_worker, &watch, workers, TRUE, NULL);
+
+    for (guint i = 0; i < watch.drives->len; i++) {
+        Drive *drive = g_ptr_array_index(watch.drives, i);
+
+        drive->watch = &watch;
+        drive->reader = g_thread_new("drive", drive_reader, drive);
+    }
+
+    fprintf(stderr, "Watching %u drive(s)\n", watch.drives->len);
+
+    while (!drives_stopping)
+        g_usleep(DRIVE_POLL_STEP * 1000);
+
+    for (guint i = 0; i < watch.drives->len; i++)
+        g_thread_join(((Drive *)g_ptr_array_index(watch.drives, i))->reader);
+
+    // Let the lookups already under way finish
+    g_thread_pool_free(watch.workers, FALSE, TRUE);
+
+    drive_watch_print_stats(&watch, (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC, stderr);
+
+    g_ptr_array_free(watch.drives, TRUE);
+    g_mutex_clear(&watch.lock);
+
+    return 0;
+}
+
+
+/*
+ * Benchmark mode
+ *
+ * Looks up synthetic discs against a stub MusicBrainz server running in
+ * this process, so runs need neither a drive nor the network, and can be
+ * compared with each other. TOCs are made up per scenario and turned into
+ * disc IDs with discid_put(); the server answers discid and release queries
+ * with XML generated for them, or with recorded responses:
+ *
+ *   --bench-fixtures DIR serves DIR/discid/<disc ID>.xml (.inc.xml for a
+ *   request with includes) and DIR/release/<MBID>.xml when they exist
+ *   (saved from https://musicbrainz.org/ws/2/...), and adds a "recorded"
+ *   scenario that looks up the TOCs listed in DIR/tocs.txt, one per line as
+ *   in batch mode. fixtures/ in the source tree is such a directory.
+ *
+ * Lookups go through the usual path (scheduler, fan-out, offline index),
+ * never through the disc cache. In compare mode each disc is looked up both
+ * ways and the benchmark fails if any of them renders differently.
+ */
+
+#define BENCHMARK_RATE 1000000.0        /* requests per second, when --rate isn't given */
+
+typedef struct {
+    const char *name;
+    guint releases;             /* per disc */
+    guint media;                /* per release */
+    guint tracks;               /* per medium */
+} BenchScenario;
+
+static const BenchScenario bench_scenarios[] = {
+    { "small", 1, 1, 10 },
+    { "popular", 30, 1, 12 },
+    { "boxset", 1, 10, 20 },
+};
+
+/* The discs of one made-up release family: every release has every medium */
+typedef struct {
+    const BenchScenario *scenario;
+    guint index;
+    gchar **release_ids;
+    gchar **discids;            /* one per medium */
+    DiscToc *tocs;              /* one per medium */
+} BenchSet;
+
+typedef struct {
+    BenchSet *set;
+    guint medium;
+} BenchDisc;
+
+typedef struct {
+    int listener;
+    guint16 port;
+    GThread *thread;
+    GHashTable *discs;          /* disc ID -> BenchDisc */
+    GHashTable *releases;       /* release ID -> BenchSet */
+    gchar *fixtures;
+    gint latency;               /* added to every response, in milliseconds */
+    gdouble throttle_rate;      /* fraction of the requests answered with a 503 */
+
+    gint discid_requests;
+    gint release_requests;
+    gint fixture_responses;
+    gint throttled_responses;
+} BenchServer;
+
+typedef struct {
+    const gchar *discid;
+    const DiscToc *toc;
+    LookupMode mode;
+    gint64 latency;             /* in microseconds */
+    gboolean found;
+    gboolean identical;         /* in compare mode, both lookup modes gave the same output */
+} BenchLookup;
+
+
+void bench_set_free(BenchSet *set)
+{
+    g_strfreev(set->release_ids);
+    g_strfreev(set->discids);
+    g_free(set->tocs);
+    g_free(set);
+}
+
+
+/* Made-up TOCs are the same on every run */
+BenchSet *bench_set_new(const BenchScenario *scenario, guint scenario_index, guint index)
+{
+    BenchSet *set = g_new0(BenchSet, 1);
+    GRand *rand = g_rand_new_with_seed(scenario_index * 1000003 + index);
+    DiscId *disc = discid_new();
+
+    set->scenario = scenario;
+    set->index = index;
+    set->release_ids = g_new0(gchar *, scenario->releases + 1);
+    set->discids = g_new0(gchar *, scenario->media + 1);
+    set->tocs = g_new0(DiscToc, scenario->media);
+
+    for (guint i = 0; i < scenario->releases; i++)
+        set->release_ids[i] = g_strdup_printf("%08x-%04x-4000-8000-%012x", scenario_index, i, index);
+
+    for (guint medium = 0; medium < scenario->media; medium++) {
+        int offsets[100] = { 0 };
+
+        offsets[1] = 150;
+        for (guint track = 2; track <= scenario->tracks + 1; track++)
+            offsets[track] = offsets[track - 1] + g_rand_int_range(rand, 4000, 4000 + 300000 / scenario->tracks);
+
+        // The lead-out takes the place of the track after the last
+        offsets[0] = offsets[scenario->tracks + 1];
+        offsets[scenario->tracks + 1] = 0;
+
+        discid_put(disc, 1, scenario->tracks, offsets);
+        set->discids[medium] = g_strdup(discid_get_id(disc));
+        disc_toc_from_discid(&set->tocs[medium], disc);
+    }
+
+    discid_free(disc);
+    g_rand_free(rand);
+
+    return set;
+}
+
+
+void bench_append_artist_credit(GString *xml, guint artist)
+{
+    g_string_append_printf(xml, "<artist-credit><name-credit><artist id=\"%08x-0000-4000-8000-000000000000\">"
+                           "<name>Artist %u</name><sort-name>Artist %u</sort-name></artist></name-credit></artist-credit>",
+                           artist, artist, artist);
+}
+
+
+/* What the discid query returns without includes is only enough to fetch the release */
+void bench_append_release(GString *xml, const BenchSet *set, guint release, gboolean full)
+{
+    const BenchScenario *scenario = set->scenario;
+    // Every third family is a compilation
+    gboolean compilation = set->index % 3 == 2;
+
+    g_string_append_printf(xml, "<release id=\"%s\"><title>%s %u</title>", set->release_ids[release], scenario->name, set->index);
+
+    if (!full) {
+        g_string_append(xml, "</release>");
+        return;
+    }
+
+    bench_append_artist_credit(xml, set->index);
+    g_string_append_printf(xml, "<release-group id=\"%s\" type=\"Album\"><title>%s %u</title></release-group>",
+                           set->release_ids[0], scenario->name, set->index);
+    g_string_append_printf(xml, "<medium-list count=\"%u\">", scenario->media);
+
+    for (guint medium = 0; medium < scenario->media; medium++) {
+        const DiscToc *toc = &set->tocs[medium];
+
+        g_string_append_printf(xml, "<medium><position>%u</position>", medium + 1);
+        if (scenario->media > 1)
+            g_string_append_printf(xml, "<title>Disc %u</title>", medium + 1);
+
+        g_string_append_printf(xml, "<disc-list count=\"1\"><disc id=\"%s\"><sectors>%u</sectors></disc></disc-list>",
+                               set->discids[medium], toc->leadout);
+        g_string_append_printf(xml, "<track-list count=\"%u\" offset=\"0\">", toc->track_count);
+
+        for (guint track = 0; track < toc->track_count; track++) {
+            guint32 end = track + 1 < toc->track_count ? toc->offsets[track + 1] : toc->leadout;
+            guint length = (end - toc->offsets[track]) * 1000 / 75;
+
+            g_string_append_printf(xml, "<track id=\"%08x-%04x-4000-8000-%012x\"><position>%u</position><number>%u</number>"
+                                   "<length>%u</length><recording id=\"%08x-%04x-4000-9000-%012x\"><title>Track %u</title><length>%u</length>",
+                                   set->index, medium, track, track + 1, track + 1, length, set->index, medium, track, track + 1, length);
+            bench_append_artist_credit(xml, compilation ? set->index * 100 + track : set->index);
+            g_string_append(xml, "</recording></track>");
+        }
+
+        g_string_append(xml, "</track-list></medium>");
+    }
+
+    g_string_append(xml, "</medium-list></release>");
+}
+
+
+/*
+ * A recorded response for the request, or NULL. A request with includes is
+ * answered from DIR/<entity>/<id>.inc.xml if there is one, anything else
+ * from DIR/<entity>/<id>.xml.
+ */
+gchar *bench_server_fixture(BenchServer *server, const gchar *entity, const gchar *id, gboolean includes)
+{
+    const gchar *suffixes[] = { ".inc.xml", ".xml" };
+    gchar *contents = NULL;
+
+    if (server->fixtures == NULL || strchr(id, '/'))
+        return NULL;
+
+    for (guint i = includes ? 0 : 1; i < G_N_ELEMENTS(suffixes) && contents == NULL; i++) {
+        gchar *name = g_strconcat(id, suffixes[i], NULL);
+        gchar *path = g_build_filename(server->fixtures, entity, name, NULL);
+
+        g_file_get_contents(path, &contents, NULL, NULL);
+        g_free(path);
+        g_free(name);
+    }
+
+    if (contents)
+        g_atomic_int_inc(&server->fixture_responses);
+
+    return contents;
+}
+
+
+/* Returns the response body, or NULL for a 404 */
+gchar *bench_server_respond(BenchServer *server, const gchar *entity, const gchar *id, gboolean includes)
+{
+    gchar *fixture = bench_server_fixture(server, entity, id, includes);
+    GString *xml;
+
+    if (fixture)
+        return fixture;
+
+    xml = g_string_new("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<metadata xmlns=\"http://musicbrainz.org/ns/mmd-2.0#\">");
+
+    if (strcmp(entity, "discid") == 0) {
+        BenchDisc *disc = g_hash_table_lookup(server->discs, id);
+
+        if (disc == NULL)
+            return g_string_free(xml, TRUE);
+
+        g_string_append_printf(xml, "<disc id=\"%s\"><sectors>%u</sectors><release-list count=\"%u\">",
+                               id, disc->set->tocs[disc->medium].leadout, disc->set->scenario->releases);
+
+        for (guint i = 0; i < disc->set->scenario->releases; i++)
+            bench_append_release(xml, disc->set, i, includes);
+
+        g_string_append(xml, "</release-list></disc>");
+    } else if (strcmp(entity, "release") == 0) {
+        BenchSet *set = g_hash_table_lookup(server->releases, id);
+        guint i = 0;
+
+        if (set == NULL)
+            return g_string_free(xml, TRUE);
+
+        while (strcmp(set->release_ids[i], id) != 0)
+            i++;
+
+        bench_append_release(xml, set, i, TRUE);
+    } else {
+        return g_string_free(xml, TRUE);
+    }
+
+    g_string_append(xml, "</metadata>\n");
+
+    return g_string_free(xml, FALSE);
+}
+
+
+typedef struct {
+    BenchServer *server;
+    int fd;
+} BenchConnection;
+
+
+/* Plain HTTP/1.1 with keep-alive, just what libmusicbrainz sends */
+gpointer bench_connection(gpointer data)
+{
+    BenchConnection *connection = data;
+    BenchServer *server = connection->server;
+    FILE *input = fdopen(dup(connection->fd), "r");
+    GString *response = g_string_new(NULL);
+    gchar *line = NULL;
+    size_t line_size = 0;
+
+    while (input && getline(&line, &line_size, input) >= 0) {
+        gchar **request = g_strsplit(g_strstrip(line), " ", 3);
+        gboolean keep_alive = TRUE;
+        gboolean throttled = FALSE;
+        gchar *body = NULL;
+
+        // Skip the headers, noting whether the client wants to close
+        while (getline(&line, &line_size, input) >= 0 && *g_strstrip(line) != '\0') {
+            if (g_ascii_strncasecmp(line, "Connection:", 11) == 0 && strstr(line + 11, "close"))
+                keep_alive = FALSE;
+        }
+
+        if (g_strv_length(request) == 3 && strcmp(request[0], "GET") == 0 && g_str_has_prefix(request[1], "/ws/2/")) {
+            gchar *path = request[1] + strlen("/ws/2/");
+            gchar *query = strchr(path, '?');
+            gchar *id;
+
+            if (query)
+                *query++ = '\0';
+
+            id = strchr(path, '/');
+            if (id) {
+                *id++ = '\0';
+
+                if (strcmp(path, "discid") == 0)
+                    g_atomic_int_inc(&server->discid_requests);
+                else if (strcmp(path, "release") == 0)
+                    g_atomic_int_inc(&server->release_requests);
+
+                // Like the real server when a client goes over its rate limit
+                throttled = server->throttle_rate > 0 && g_random_double() < server->throttle_rate;
+
+                if (throttled)
+                    g_atomic_int_inc(&server->throttled_responses);
+                else
+                    body = bench_server_respond(server, path, id, query && strstr(query, "inc=") != NULL);
+            }
+        }
+
+        if (server->latency > 0)
+            g_usleep(server->latency * 1000);
+
+        g_string_truncate(response, 0);
+
+        if (body) {
+            g_string_append_printf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/xml; charset=UTF-8\r\nContent-Length: %zu\r\n%s\r\n%s",
+                                   strlen(body), keep_alive ? "" : "Connection: close\r\n", body);
+        } else if (throttled) {
+            const gchar *error = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<error><text>Your requests are exceeding the allowable rate limit.</text></error>\n";
+
+            g_string_append_printf(response, "HTTP/1.1 503 Service Unavailable\r\nContent-Type: application/xml; charset=UTF-8\r\nContent-Length: %zu\r\n%s\r\n%s",
+                                   strlen(error), keep_alive ? "" : "Connection: close\r\n", error);
+        } else {
+            const gchar *error = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<error><text>Not Found</text></error>\n";
+
+            g_string_append_printf(response, "HTTP/1.1 404 Not Found\r\nContent-Type: application/xml; charset=UTF-8\r\nContent-Length: %zu\r\n%s\r\n%s",
+                                   strlen(error), keep_alive ? "" : "Connection: close\r\n", error);
+        }
+
+        g_free(body);
+        g_strfreev(request);
+
+        if (!write_all(connection->fd, response->str, response->len) || !keep_alive)
+            break;
+    }
+
+    if (input)
+        fclose(input);
+
+    close(connection->fd);
+    g_string_free(response, TRUE);
+    free(line);
+    g_free(connection);
+
+    return NULL;
+}
+
+
+gpointer bench_server_accept(gpointer data)
+{
+    BenchServer *server = data;
+    int fd;
+
+    // Ends when bench_server_stop() shuts the listener down
+    while ((fd = accept(server->listener, NULL, NULL)) >= 0) {
+        BenchConnection *connection = g_new0(BenchConnection, 1);
+
+        connection->server = server;
+        connection->fd = fd;
+        g_thread_unref(g_thread_new("bench-connection", bench_connection, connection));
+    }
+
+    return NULL;
+}
+
+
+gboolean bench_server_start(BenchServer *server)
+{
+    struct sockaddr_in address = { 0 };
+    socklen_t length = sizeof(address);
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (server->listener < 0 || bind(server->listener, (struct sockaddr *)&address, sizeof(address)) != 0
+        || listen(server->listener, 64) != 0 || getsockname(server->listener, (struct sockaddr *)&address, &length) != 0) {
+        fprintf(stderr, "Error: cannot start the stub server: %s\n", g_strerror(errno));
+        if (server->listener >= 0)
+            close(server->listener);
+        return FALSE;
+    }
+
+    server->port = ntohs(address.sin_port);
+    server->thread = g_thread_new("bench-server", bench_server_accept, server);
+
+    return TRUE;
+}
+
+
+void bench_server_stop(BenchServer *server)
+{
+    shutdown(server->listener, SHUT_RDWR);
+    g_thread_join(server->thread);
+    close(server->listener);
+}
+
+
+void bench_worker(gpointer data, gpointer user_data)
+{
+    BenchLookup *lookup = data;
+    gint64 start = g_get_monotonic_time();
+    DiscResult *result;
+
+    if (lookup->mode == LOOKUP_MODE_COMPARE) {
+        GString *single = g_string_new(NULL);
+        GString *per_release = g_string_new(NULL);
+
+        lookup->identical = compare_lookup_modes(thread_query(), QUERY_PRIORITY_BULK, lookup->discid, single, per_release);
+        lookup->latency = g_get_monotonic_time() - start;
+        lookup->found = lookup->identical;
+
+        if (!lookup->identical)
+            fprintf(stderr, "Lookup modes differ for %s\nSingle query gave:\n%sPer-release lookup gave:\n%s",
+                    lookup->discid, single->str, per_release->str);
+
+        g_string_free(per_release, TRUE);
+        g_string_free(single, TRUE);
+        return;
+    }
+
+    result = lookup_disc(thread_query(), QUERY_PRIORITY_BULK, NULL, lookup->discid, lookup->toc, lookup->mode);
+
+    lookup->latency = g_get_monotonic_time() - start;
+    lookup->found = result->releases != NULL && result->releases->len > 0 && result->failed_releases == 0;
+
+    disc_result_free(result);
+}
+
+
+/*
+ * Start a new resident set high-water mark, so each scenario reports its own
+ * peak. Returns FALSE if the kernel doesn't let us, and the peak stays the
+ * one since the process started.
+ */
+gboolean reset_peak_rss(void)
+{
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    gboolean reset;
+
+    if (clear_refs == NULL)
+        return FALSE;
+
+    reset = fputs("5", clear_refs) >= 0;
+
+    return fclose(clear_refs) == 0 && reset;
+}
+
+
+/* VmHWM, or the peak of the whole run from getrusage() if it can't be read */
+glong peak_rss_kib(void)
+{
+    FILE *status = fopen("/proc/self/status", "r");
+    struct rusage usage;
+    glong peak = -1;
+    gchar line[256];
+
+    while (status && peak < 0 && fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %ld kB", &peak) != 1)
+            peak = -1;
+    }
+
+    if (status)
+        fclose(status);
+
+    if (peak >= 0)
+        return peak;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_maxrss;
+}
+
+
+/*
+ * Look every disc up once on a pool of workers, and report how it went.
+ * Returns FALSE if compare mode found a disc the lookup modes disagree on.
+ */
+gboolean bench_run(const gchar *name, GPtrArray *discids, GArray *tocs, LookupMode mode, gint workers, BenchServer *server)
+{
+    BenchLookup *lookups = g_new0(BenchLookup, discids->len);
+    gint64 *latencies = g_new(gint64, discids->len);
+    gint strings = g_atomic_int_get(&arena_string_count);
+    gint blocks = g_atomic_int_get(&arena_block_count);
+    gint discid_requests = g_atomic_int_get(&server->discid_requests);
+    gint release_requests = g_atomic_int_get(&server->release_requests);
+    gint throttled_responses = g_atomic_int_get(&server->throttled_responses);
+    gboolean own_peak = reset_peak_rss();
+    GThreadPool *pool = g_thread_pool_new(bench_worker, NULL, workers, FALSE, NULL);
+    gint64 start = g_get_monotonic_time();
+    gdouble elapsed;
+    guint found = 0;
+    guint identical = 0;
+    guint n = discids->len;
+
+    for (guint i = 0; i < n; i++) {
+        lookups[i].discid = g_ptr_array_index(discids, i);
+        lookups[i].toc = &g_array_index(tocs, DiscToc, i);
+        lookups[i].mode = mode;
+        g_thread_pool_push(pool, &lookups[i], NULL);
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+    elapsed = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+    for (guint i = 0; i < n; i++) {
+        latencies[i] = lookups[i].latency;
+        found += lookups[i].found;
+        identical += lookups[i].identical;
+    }
+
+    qsort(latencies, n, sizeof(gint64), compare_gint64);
+
+    printf("Benchmark %s: %u lookup(s), %u found, in %.2f s, %.1f lookups/s\n", name, n, found, elapsed, elapsed > 0 ? n / elapsed : 0.0);
+
+    if (n > 0)
+        printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               latencies[n / 2] / 1000.0, latencies[n * 9 / 10] / 1000.0, latencies[n * 99 / 100] / 1000.0, latencies[n - 1] / 1000.0);
+
+    printf("Requests: %d discid, %d release\n",
+           g_atomic_int_get(&server->discid_requests) - discid_requests, g_atomic_int_get(&server->release_requests) - release_requests);
+    if (server->throttle_rate > 0)
+        printf("Throttled: %d response(s) were 503s\n", g_atomic_int_get(&server->throttled_responses) - throttled_responses);
+    printf("Allocations: %d string(s) in %d arena block(s)\n",
+           g_atomic_int_get(&arena_string_count) - strings, g_atomic_int_get(&arena_block_count) - blocks);
+    printf("Peak RSS: %ld KiB%s, %" G_GSIZE_FORMAT " KiB now\n",
+           peak_rss_kib(), own_peak ? "" : " since start", resident_memory() >> 10);
+
+    if (mode == LOOKUP_MODE_COMPARE)
+        printf("Lookup modes: %u identical, %u different\n", identical, n - identical);
+
+    g_free(latencies);
+    g_free(lookups);
+
+    return mode != LOOKUP_MODE_COMPARE || identical == n;
+}
+
+
+/* The TOCs of the recorded scenario, in batch input format */
+gboolean bench_load_recorded(const gchar *fixtures, GPtrArray *discids, GArray *tocs)
+{
+    gchar *path = g_build_filename(fixtures, "tocs.txt", NULL);
+    gchar *contents = NULL;
+    GError *error = NULL;
+    gchar **lines;
+
+    if (!g_file_get_contents(path, &contents, NULL, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+        g_free(path);
+        return FALSE;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+
+    for (gchar **line = lines; *line; line++) {
+        DiscToc toc;
+        gchar *discid;
+
+        if (*g_strstrip(*line) == '\0')
+            continue;
+
+        discid = discid_from_line(*line, &toc, &error);
+        if (discid == NULL) {
+            fprintf(stderr, "Warning: %s: %s\n", path, error->message);
+            g_clear_error(&error);
+            continue;
+        }
+
+        g_ptr_array_add(discids, discid);
+        g_array_append_val(tocs, toc);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+    g_free(path);
+
+    return TRUE;
+}
+
+
+int run_benchmark(const gchar *scenario_list, LookupMode mode, gint workers, gint disc_count, gint latency, gdouble throttle_rate, const gchar *fixtures)
+{
+    BenchServer server = { 0 };
+    GPtrArray *sets = g_ptr_array_new_with_free_func((GDestroyNotify)bench_set_free);
+    gchar **names = g_strsplit(scenario_list, ",", -1);
+    gboolean all = g_strv_contains((const gchar * const *)names, "all");
+    int status = 0;
+
+    server.discs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    server.releases = g_hash_table_new(g_str_hash, g_str_equal);
+    server.fixtures = (gchar *)fixtures;
+    server.latency = latency;
+    server.throttle_rate = throttle_rate;
+
+    // Make up every scenario's discs before the server answers anything
+    for (guint i = 0; i < G_N_ELEMENTS(bench_scenarios); i++) {
+        const BenchScenario *scenario = &bench_scenarios[i];
+
+        if (!all && !g_strv_contains((const gchar * const *)names, scenario->name))
+            continue;
+
+        for (guint index = 0; index * scenario->media < (guint)disc_count; index++) {
+            BenchSet *set = bench_set_new(scenario, i, index);
+
+            for (guint medium = 0; medium < scenario->media; medium++) {
+                BenchDisc *disc = g_new(BenchDisc, 1);
+
+                disc->set = set;
+                disc->medium = medium;
+                g_hash_table_insert(server.discs, set->discids[medium], disc);
+            }
+
+            for (guint release = 0; release < scenario->releases; release++)
+                g_hash_table_insert(server.releases, set->release_ids[release], set);
+
+            g_ptr_array_add(sets, set);
+        }
+    }
+
+    for (gchar **name = names; *name; name++) {
+        gboolean known = g_strcmp0(*name, "all") == 0 || (fixtures && g_strcmp0(*name, "recorded") == 0);
+
+        for (guint i = 0; i < G_N_ELEMENTS(bench_scenarios); i++)
+            known = known || g_strcmp0(*name, bench_scenarios[i].name) == 0;
+
+        if (!known) {
+            if (g_strcmp0(*name, "recorded") == 0)
+                fprintf(stderr, "Error: the recorded scenario needs --bench-fixtures\n");
+            else
+                fprintf(stderr, "Error: unknown benchmark scenario '%s'\n", *name);
+            status = 1;
+        }
+    }
+
+    if (status == 0 && bench_server_start(&server)) {
+        g_free(query_server);
+        query_server = g_strdup("127.0.0.1");
+        query_port = server.port;
+
+        printf("Stub server on 127.0.0.1:%u, %d ms latency, %d worker(s)\n", server.port, latency, workers);
+        if (throttle_rate > 0)
+            printf("Stub server answers %.1f%% of the requests with a 503\n", throttle_rate * 100);
+
+        for (guint i = 0; i < G_N_ELEMENTS(bench_scenarios); i++) {
+            const BenchScenario *scenario = &bench_scenarios[i];
+            GPtrArray *discids = g_ptr_array_new();
+            GArray *tocs = g_array_new(FALSE, FALSE, sizeof(DiscToc));
+
+            for (guint j = 0; j < sets->len; j++) {
+                BenchSet *set = g_ptr_array_index(sets, j);
+
+                for (guint medium = 0; set->scenario == scenario && medium < scenario->media && discids->len < (guint)disc_count; medium++) {
+                    g_ptr_array_add(discids, set->discids[medium]);
+                    g_array_append_val(tocs, set->tocs[medium]);
+                }
+            }
+
+            if (discids->len > 0 && !bench_run(scenario->name, discids, tocs, mode, workers, &server))
+                status = 1;
+
+            g_array_free(tocs, TRUE);
+            g_ptr_array_free(discids, TRUE);
+        }
+
+        if (fixtures && (all || g_strv_contains((const gchar * const *)names, "recorded"))) {
+            GPtrArray *discids = g_ptr_array_new_with_free_func(g_free);
+            GArray *tocs = g_array_new(FALSE, FALSE, sizeof(DiscToc));
+
+            if (!bench_load_recorded(fixtures, discids, tocs) || !bench_run("recorded", discids, tocs, mode, workers, &server))
+                status = 1;
+
+            printf("Recorded responses served: %d\n", g_atomic_int_get(&server.fixture_responses));
+
+            g_array_free(tocs, TRUE);
+            g_ptr_array_free(discids, TRUE);
+        }
+
+        bench_server_stop(&server);
+    } else {
+        status = 1;
+    }
+
+    g_hash_table_destroy(server.releases);
+    g_hash_table_destroy(server.discs);
+    g_ptr_array_free(sets, TRUE);
+    g_strfreev(names);
+
+    return status;
+}
+
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    LookupMode mode = LOOKUP_MODE_SINGLE;
+    OutputFormat format;
+    OutputWriter output;
+    DiscCache *cache;
+    int status = 0;
+
+    context = g_option_context_new("- look up the disc in /dev/cdrom on MusicBrainz");
+    g_option_context_add_main_entries(context, option_entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (opt_lookup_mode == NULL || g_strcmp0(opt_lookup_mode, "single") == 0) {
+        mode = LOOKUP_MODE_SINGLE;
+    } else if (g_strcmp0(opt_lookup_mode, "per-release") == 0) {
+        mode = LOOKUP_MODE_PER_RELEASE;
+    } else if (g_strcmp0(opt_lookup_mode, "compare") == 0) {
+        mode = LOOKUP_MODE_COMPARE;
+    } else {
+        fprintf(stderr, "Error: unknown lookup mode '%s'\n", opt_lookup_mode);
+        return 1;
+    }
+
+    if (!output_format_from_string(opt_format, &format)) {
+        fprintf(stderr, "Error: unknown output format '%s'\n", opt_format);
+        return 1;
+    }
+
+    // Compare mode reports on the text of both lookups
+    if (mode == LOOKUP_MODE_COMPARE && format != OUTPUT_FORMAT_TEXT) {
+        fprintf(stderr, "Error: compare mode only writes text\n");
+        return 1;
+    }
+
+    if (opt_inc) {
+        gchar **includes = g_strsplit(opt_inc, " ", -1);
+        gboolean has_discids = g_strv_contains((const gchar * const *)includes, "discids");
+
+        g_strfreev(includes);
+
+        // Without them no medium of a fetched release matches the disc
+        if (!has_discids) {
+            fprintf(stderr, "Error: --inc must keep discids\n");
+            return 1;
+        }
+
+        release_includes = opt_inc;
+    }
+
+    memory_ceiling = (gsize)MAX(opt_max_memory, 0) << 20;
+
+    if (opt_metrics && g_strcmp0(opt_metrics, "json") != 0 && g_strcmp0(opt_metrics, "prometheus") != 0) {
+        fprintf(stderr, "Error: unknown metrics format '%s'\n", opt_metrics);
+        return 1;
+    }
+
+    // The daemon answers METRICS requests, so it always keeps them
+    metrics_enabled = opt_metrics != NULL || opt_daemon != NULL;
+
+    if (opt_import_dump) {
+        if (opt_index == NULL) {
+            fprintf(stderr, "Error: --import-dump needs --index to say where the index goes\n");
+            return 1;
+        }
+
+        return import_dump(opt_import_dump, opt_index, MAX(opt_workers, 1));
+    }
+
+    if (opt_server) {
+        gchar **host_port = g_strsplit(opt_server, ":", 2);
+
+        query_server = g_strdup(host_port[0]);
+        query_port = host_port[1] ? atoi(host_port[1]) : 0;
+
+        g_strfreev(host_port);
+    }
+
+    if (opt_rate <= 0)
+        opt_rate = opt_benchmark ? BENCHMARK_RATE : SCHEDULER_DEFAULT_RATE;
+
+    query_scheduler_init(&scheduler, opt_rate, opt_burst, MAX(opt_max_retries, 0));
+
+    if (opt_fanout > 1)
+        fanout_pool = g_thread_pool_new(release_fetch_worker, NULL, opt_fanout, FALSE, NULL);
+
+    cache = open_default_cache();
+
+    // Siblings only pay off if there is somewhere to keep them, benchmarks keep nothing
+    prefetch_media = !opt_no_prefetch && opt_benchmark == NULL && (cache != NULL || opt_daemon != NULL);
+
+    fuzzy_tolerance = CLAMP(opt_fuzzy_tolerance, 0, FUZZY_MAX_TOLERANCE);
+
+    // Compare mode is about the network paths, it leaves the index alone
+    if (opt_index && mode != LOOKUP_MODE_COMPARE) {
+        offline_index = offline_index_open(opt_index, &error);
+        if (offline_index == NULL) {
+            fprintf(stderr, "Warning: %s\n", error->message);
+            g_clear_error(&error);
+        }
+    }
+
+    output_writer_init(&output, stdout, format, opt_flush);
+
+    if (opt_benchmark)
+        status = run_benchmark(opt_benchmark, mode, MAX(opt_workers, 1), MAX(opt_bench_discs, 1), MAX(opt_bench_latency, 0),
+                               CLAMP(opt_bench_503_rate, 0.0, 1.0), opt_bench_fixtures);
+    else if (opt_daemon)
+        status = run_daemon(opt_daemon, mode, cache, MAX(opt_workers, 1), MAX(opt_lru_size, 0));
+    else if (opt_devices || opt_toc_dir)
+        status = run_drives(opt_devices, opt_toc_dir, mode, cache, MAX(opt_workers, 1), MAX(opt_poll_interval, 1), &output);
+    else if (opt_batch)
+        status = lookup_batch(opt_batch, mode, cache, MAX(opt_workers, 1), !opt_unordered, &output);
+    else
+        status = lookup_single_disc(mode, cache, &output);
+
+    // Benchmarks and the daemon write nothing to stdout, so no empty JSON array either
+    if (opt_benchmark == NULL && opt_daemon == NULL)
+        output_writer_finish(&output);
+    else
+        g_string_free(output.buffer, TRUE);
+
+    if (cache) {
+        if (opt_cache_stats)
+            disc_cache_print_stats(cache, stderr);
+
+        disc_cache_close(cache);
+    }
+
+    if (fanout_pool)
+        g_thread_pool_free(fanout_pool, FALSE, TRUE);
+
+    if (offline_index)
+        offline_index_close(offline_index);
+
+    if (opt_scheduler_stats)
+        query_scheduler_print_stats(&scheduler, stderr);
+
+    if (opt_alloc_stats)
+        print_alloc_stats(stderr);
+
+    if (opt_metrics) {
+        GString *out = g_string_new(NULL);
+        FILE *stream = opt_metrics_file ? fopen(opt_metrics_file, "w") : stderr;
+
+        metrics_append(out, opt_metrics);
+
+        if (stream) {
+            fputs(out->str, stream);
+            if (stream != stderr)
+                fclose(stream);
+        } else {
+            fprintf(stderr, "Error: can't write %s: %s\n", opt_metrics_file, g_strerror(errno));
+            status = 1;
+        }
+
+        g_string_free(out, TRUE);
+    }
+
+    return status;
 }